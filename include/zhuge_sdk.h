@@ -4,14 +4,24 @@
 #include <string>
 #include <atomic>
 #include <queue>
+#include <deque>
 #include <list>
+#include <map>
 #include <set>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <utility>
 #include <future>
+#include <functional>
 #include <mutex>
 #include <random>
 #include <ostream>
 #include <sstream>
+#include <fstream>
 #include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <exception>
 #include "json.h"
 
@@ -25,12 +35,19 @@ namespace zhugeio
 	static const char* ZHUGE_PLATFORM_ANDROID = "and";  // 安卓平台
 	static const char* ZHUGE_PLATFORM_IOS = "ios";  // iOS平台
 
+	// 数据上传请求体格式
+	static const std::string ZHUGE_UPLOAD_BODY_FORM = "form";  // 表单格式，event=URL编码后的JSON
+	static const std::string ZHUGE_UPLOAD_BODY_JSON = "json";  // 直接以application/json上传JSON
+	static const std::string ZHUGE_UPLOAD_BODY_GZIP = "gzip";  // gzip压缩后的JSON，需要定义CPPHTTPLIB_ZLIB_SUPPORT
+
 	// 诸葛SDK上传数据类型
 	const char* const ZG_EVT = "evt";  // 事件类型数据
 	const char* const ZG_USR = "usr";  // 用户类型数据
 	const char* const ZG_PL = "pl";    // 平台类型数据
 	const char* const ZG_SS = "ss";    // 会话开始类型数据
 	const char* const ZG_SE = "se";    // 会话结束类型数据
+	const char* const ZG_BATCH = "batch";  // 批量上报的事件，只在SDK内部使用，上传前会被展开
+	const char* const ZG_FLUSH = "flush";  // Flush标记，只在SDK内部使用，不会被上传
 
 	// 默认配置常量
 	static const std::string DEFAULT_API_PATH = "/apipool";
@@ -43,6 +60,222 @@ namespace zhugeio
 	static const int DEFAULT_API_READ_TIMEOUT_S = 5;
 	static const int DEFAULT_API_WRITE_TIMEOUT_S = 10;
 	static const unsigned int DEFAULT_MAX_STORAGE_RECORDS = 1000;
+	static const double DEFAULT_ENDPOINT_EWMA_ALPHA = 0.3;
+	static const int DEFAULT_ENDPOINT_MAX_FAILURES = 3;
+	static const int DEFAULT_ENDPOINT_COOLDOWN_MILLISECONDS = 30000;
+	static const size_t DEFAULT_MAX_FRAME_BYTES = 256 * 1024;
+	static const size_t DEFAULT_EVENT_POOL_SIZE = 1024;
+	static const size_t DEFAULT_EVENT_THREAD_CACHE_SIZE = 64;
+	static const size_t DEFAULT_CONTEXT_THREAD_CACHE_SIZE = 8;
+	static const std::string DEFAULT_METRICS_HOST = "127.0.0.1";
+	static const size_t DEFAULT_LOG_RING_SIZE = 4096;
+	static const size_t DEFAULT_LOG_MAX_MESSAGE_BYTES = 512;
+	static const int DEFAULT_LOG_MESSAGES_PER_SECOND = 20;
+	static const int DEFAULT_TRACE_SAMPLE_INTERVAL = 1000;
+
+	// 日志级别
+	enum ZhugeLogLevel
+	{
+		ZHUGE_LOG_DEBUG = 0,  // 上传数据、后台任务周期等调试信息
+		ZHUGE_LOG_INFO,  // 初始化、关闭等运行信息
+		ZHUGE_LOG_WARN,  // 上传失败、数据被丢弃等需要关注的问题
+		ZHUGE_LOG_ERROR  // 异常
+	};
+
+	// 日志接口
+	// 实现该接口并通过ZhugeSDKConfig::Logger设置，即可将SDK日志接入应用自己的日志系统，
+	// Log可能在SDK的任意线程中被调用，实现需要保证线程安全，并且尽快返回
+	class ZhugeSDKLogger
+	{
+	public:
+		virtual void Log(ZhugeLogLevel level, const std::string& message) = 0;
+
+		virtual ~ZhugeSDKLogger()
+		{
+
+		}
+	};
+
+	// 默认的异步日志
+	// 日志先写入无锁的环形缓冲区，由独立线程批量写入输出流，埋点线程不会等待输出流；
+	// 缓冲区已满时丢弃日志，并在之后输出丢弃的数目
+	class ZhugeSDKAsyncLogger : public ZhugeSDKLogger
+	{
+	private:
+		struct Slot
+		{
+			std::atomic<size_t> sequence;
+			ZhugeLogLevel level;
+			std::string message;
+		};
+		std::unique_ptr<Slot[]> slots;
+		size_t mask;
+		std::atomic<size_t> enqueue_pos;
+		size_t dequeue_pos;  // 只在输出线程中访问
+		std::atomic<unsigned long long> dropped;
+		std::ostream& out;
+		bool stop_mark;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::thread writer_thread;
+		bool Dequeue(ZhugeLogLevel& level, std::string& message);
+		void Write();
+	public:
+		// capacity为环形缓冲区容量，会被向上取整为2的幂
+		ZhugeSDKAsyncLogger(std::ostream& out = std::clog, size_t capacity = DEFAULT_LOG_RING_SIZE);
+
+		virtual void Log(ZhugeLogLevel level, const std::string& message);
+
+		// 因缓冲区已满而被丢弃的日志数
+		unsigned long long GetDropped() const;
+
+		// 输出缓冲区中剩余的日志之后返回
+		virtual ~ZhugeSDKAsyncLogger();
+	};
+
+	// 追踪阶段
+	enum ZhugeTraceStage
+	{
+		ZHUGE_TRACE_TRACK = 0,  // 事件：从调用Track到加入上传队列之前
+		ZHUGE_TRACE_QUEUE_WAIT,  // 事件：在上传队列中等待上传线程取出
+		ZHUGE_TRACE_ENRICH,  // 事件：上传线程填充事件属性
+		ZHUGE_TRACE_SERIALIZE,  // 批次：序列化为JSON
+		ZHUGE_TRACE_SAVE,  // 批次：写入本地存储
+		ZHUGE_TRACE_SPOOL_WAIT,  // 批次：在本地存储中等待第一次上传
+		ZHUGE_TRACE_SEND,  // 批次：一次上传请求，从发送到收到响应
+		ZHUGE_TRACE_ACK  // 批次：上传成功，即将从本地存储中删除，开始与结束时间相同
+	};
+
+	// 追踪阶段名称
+	const char* ZhugeTraceStageName(ZhugeTraceStage stage);
+
+	// 一个阶段的追踪记录，时间为std::chrono::steady_clock的纳秒数
+	struct ZhugeTraceSpan
+	{
+		ZhugeTraceStage stage;
+		unsigned long long trace_id;  // 被采样事件的追踪ID，批次阶段为0
+		unsigned long long batch_id;  // 事件所在批次的追踪ID
+		long long begin;
+		long long end;
+		std::string detail;  // 事件阶段为事件名称，上传阶段为上传节点与响应状态
+	};
+
+	// 追踪接口
+	// 实现该接口并通过ZhugeSDKConfig::Tracer设置，即可记录被采样事件从Track到上传成功的各阶段耗时。
+	// 事件的各阶段在所在批次写入本地存储时一并输出，Record只在上传线程中被调用
+	class ZhugeSDKTracer
+	{
+	public:
+		virtual void Record(const ZhugeTraceSpan& span) = 0;
+
+		virtual ~ZhugeSDKTracer()
+		{
+
+		}
+	};
+
+	// 以Chrome trace event格式将追踪记录写入本地文件，可以在chrome://tracing或Perfetto中查看。
+	// 每个被采样的事件与批次各占一行，事件记录在pid 1下，批次记录在pid 2下
+	class ZhugeSDKChromeTraceWriter : public ZhugeSDKTracer
+	{
+	private:
+		std::ofstream out;
+		std::mutex mutex;
+	public:
+		ZhugeSDKChromeTraceWriter(const std::string& path);
+
+		virtual void Record(const ZhugeTraceSpan& span);
+
+		// 写入结束标记并关闭文件
+		virtual ~ZhugeSDKChromeTraceWriter();
+	};
+
+	// 执行器接口
+	// SDK的序列化与上传以任务的形式提交给执行器，同一个SDK对象同一时间只有一个任务在执行。
+	// 实现该接口并通过ZhugeSDKConfig::Executor设置，即可让SDK运行在应用自己的线程池中。
+	// 任务中会执行网络请求，可能持续到上传超时时间，执行器不能在任务中等待Flush的结果
+	class ZhugeSDKExecutor
+	{
+	public:
+		// 尽快执行任务，也可以直接在调用者线程中执行，SDK不会在持有内部锁时提交任务
+		virtual void Execute(std::function<void()> task) = 0;
+
+		// 在指定的毫秒数之后执行任务
+		virtual void ExecuteAfter(long long delay_milliseconds, std::function<void()> task) = 0;
+
+		virtual ~ZhugeSDKExecutor()
+		{
+
+		}
+	};
+
+	// 内置的工作线程池
+	// 每个工作线程有自己的任务队列，优先执行自己队列头部的任务，空闲时从其它队列的尾部窃取任务；
+	// 延迟任务由空闲的工作线程在到期时取出执行。多个SDK对象设置同一个线程池即可共用工作线程，
+	// 未设置执行器的SDK对象会各自创建一个单线程的线程池
+	class ZhugeSDKWorkerPool : public ZhugeSDKExecutor
+	{
+	private:
+		struct Worker
+		{
+			std::deque<std::function<void()>> tasks;
+			std::mutex mutex;
+			std::thread thread;
+		};
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::atomic<size_t> next_worker;  // 其它线程提交任务时轮流选择的队列
+		std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers;  // 按到期时间排列的延迟任务
+		size_t pending;  // 已经提交尚未被取出的任务数
+		bool stop_mark;
+		std::mutex mutex;  // 保护timers、pending与stop_mark
+		std::condition_variable cond;
+		bool Take(size_t index, std::function<void()>& task);
+		void Work(size_t index);
+	public:
+		ZhugeSDKWorkerPool(size_t threads = 1);
+
+		virtual void Execute(std::function<void()> task);
+
+		virtual void ExecuteAfter(long long delay_milliseconds, std::function<void()> task);
+
+		// 执行完队列中的任务之后退出，尚未到期的延迟任务被丢弃
+		virtual ~ZhugeSDKWorkerPool();
+	};
+
+	// 数据上传API节点
+	struct ZhugeSDKEndpoint
+	{
+		std::string host;
+		int port;
+	};
+
+	// 一次上传请求的结果
+	struct ZhugeSDKUploadResult
+	{
+		bool success;  // 是否上传成功，成功的批次会从本地存储中删除
+		size_t batches;  // 请求中合并的批次数
+		size_t bytes;  // 请求体字节数
+		int status;  // 最后一次尝试的HTTP状态码，网络错误或没有可用节点时为0
+		std::string endpoint;  // 最后一次尝试的上传节点，格式为host:port
+	};
+
+	// 上传结果回调，在上传线程中被调用，需要尽快返回，并且不能在回调中等待Flush的结果
+	typedef std::function<void(const ZhugeSDKUploadResult&)> ZhugeSDKUploadCallback;
+
+	// 事件优先级，决定上传队列或存储积压时事件被丢弃的顺序
+	enum ZhugeEventPriority
+	{
+		ZHUGE_EVENT_CRITICAL = 0,  // 关键事件，例如支付，不采样，也不会因为超过队列配额而被丢弃
+		ZHUGE_EVENT_NORMAL,  // 普通事件，超过队列配额时丢弃
+		ZHUGE_EVENT_LOW  // 低优先级事件，例如高频的运行数据，队列配额或内存存储使用过半时即开始丢弃
+	};
+
+	// 按事件名称配置的上报策略
+	struct ZhugeEventPolicy
+	{
+		ZhugeEventPriority priority;
+		double sample_rate;  // 采样率，0~1，1为全部上报
+	};
 
 	// SDK配置构造者
 	class ZhugeSDKConfig
@@ -97,6 +330,72 @@ namespace zhugeio
 		// 上传数据保存文件
 		std::string storage_file_path;
 
+		// 启动时是否扫描数据目录修复索引，加入索引中没有的数据文件
+		bool repair_storage;
+
+		// 关闭时内存中未上传数据的写入目录，为空时不写入
+		std::string spill_file_path;
+
+		// 全部数据上传API节点，第一个为构造函数指定的api_host与api_port
+		std::vector<ZhugeSDKEndpoint> api_endpoints;
+
+		// 上传请求体格式
+		std::string upload_body_mode;
+
+		// 一次网络请求合并上传的批次最大字节数
+		size_t max_frame_bytes;
+
+		// 每秒最大上传字节数，0为不限制
+		size_t max_upload_bytes_per_second;
+
+		// 上传突发字节数，0为与每秒最大上传字节数相同
+		size_t upload_burst_bytes;
+
+		// 每秒最大上传请求数，0为不限制
+		double max_upload_requests_per_second;
+
+		// 事件时间戳缓存精度，单位毫秒，0为每次读取系统时钟
+		int clock_resolution_milliseconds;
+
+		// 是否由上传线程延迟填充事件的系统属性与公共属性
+		bool deferred_enrichment;
+
+		// Prometheus指标接口绑定的地址
+		std::string metrics_host;
+
+		// Prometheus指标接口端口，0为不开启
+		int metrics_port;
+
+		// 日志级别，低于该级别的日志不会输出
+		ZhugeLogLevel log_level;
+
+		// 日志输出，为空时使用异步写入std::clog的默认日志
+		std::shared_ptr<ZhugeSDKLogger> logger;
+
+		// 单条日志最大字节数，超出部分被截断
+		size_t log_max_message_bytes;
+
+		// 每个日志输出位置每秒最多输出的日志数，0为不限制
+		int max_log_messages_per_second;
+
+		// 追踪输出，为空时不追踪
+		std::shared_ptr<ZhugeSDKTracer> tracer;
+
+		// 追踪采样间隔，每个线程每该数目次Track追踪一次
+		int trace_sample_interval;
+
+		// 上传结果回调，为空时不回调
+		ZhugeSDKUploadCallback upload_callback;
+
+		// 每个App key在上传队列中等待序列化的最大事件数，超出时丢弃新的事件，0为不限制
+		size_t max_queued_events;
+
+		// 执行序列化与上传任务的执行器，为空时使用独立的单线程线程池
+		std::shared_ptr<ZhugeSDKExecutor> executor;
+
+		// 按事件名称配置的采样率与优先级，未配置的事件为普通优先级并全部上报
+		std::unordered_map<std::string, ZhugeEventPolicy> event_policies;
+
 		ZhugeSDKConfig(
 			const std::string api_host,
 			const int api_port,
@@ -129,6 +428,52 @@ namespace zhugeio
 
 		ZhugeSDKConfig& StorageFilePath(const std::string storage_file_path);
 
+		ZhugeSDKConfig& RepairStorage(const bool repair_storage);
+
+		ZhugeSDKConfig& SpillFilePath(const std::string spill_file_path);
+
+		ZhugeSDKConfig& UploadBodyMode(const std::string upload_body_mode);
+
+		ZhugeSDKConfig& MaxFrameBytes(const size_t max_frame_bytes);
+
+		ZhugeSDKConfig& MaxUploadBytesPerSecond(const size_t max_upload_bytes_per_second);
+
+		ZhugeSDKConfig& UploadBurstBytes(const size_t upload_burst_bytes);
+
+		ZhugeSDKConfig& MaxUploadRequestsPerSecond(const double max_upload_requests_per_second);
+
+		ZhugeSDKConfig& AddAPIEndpoint(const std::string api_host, const int api_port);
+
+		ZhugeSDKConfig& ClockResolutionMilliseconds(const int clock_resolution_milliseconds);
+
+		ZhugeSDKConfig& DeferredEnrichment(const bool deferred_enrichment);
+
+		ZhugeSDKConfig& MetricsHost(const std::string metrics_host);
+
+		ZhugeSDKConfig& MetricsPort(const int metrics_port);
+
+		ZhugeSDKConfig& LogLevel(const ZhugeLogLevel log_level);
+
+		ZhugeSDKConfig& Logger(std::shared_ptr<ZhugeSDKLogger> logger);
+
+		ZhugeSDKConfig& LogMaxMessageBytes(const size_t log_max_message_bytes);
+
+		ZhugeSDKConfig& MaxLogMessagesPerSecond(const int max_log_messages_per_second);
+
+		ZhugeSDKConfig& Tracer(std::shared_ptr<ZhugeSDKTracer> tracer);
+
+		ZhugeSDKConfig& UploadCallback(ZhugeSDKUploadCallback upload_callback);
+
+		ZhugeSDKConfig& TraceSampleInterval(const int trace_sample_interval);
+
+		ZhugeSDKConfig& MaxQueuedEvents(const size_t max_queued_events);
+
+		ZhugeSDKConfig& Executor(std::shared_ptr<ZhugeSDKExecutor> executor);
+
+		ZhugeSDKConfig& EventSampleRate(const std::string& event_name, const double sample_rate);
+
+		ZhugeSDKConfig& EventPriority(const std::string& event_name, const ZhugeEventPriority priority);
+
 		friend std::ostream& operator<<(std::ostream& out, ZhugeSDKConfig config);
 	};
 
@@ -150,12 +495,78 @@ namespace zhugeio
 		}
 	};
 
+	// 属性名句柄
+	// 持有已经带有$或_前缀的属性名，由ZhugePropertyKeys生成，在进程生命周期内一直有效，
+	// 写入属性时以Json::StaticString作为键，不需要再拼接与复制属性名
+	class ZhugePropertyKey
+	{
+	private:
+		const std::string* name;
+		explicit ZhugePropertyKey(const std::string* name) : name(name) {}
+		friend class ZhugePropertyKeys;
+	public:
+		// 获取带有前缀的属性名
+		inline const std::string& Name() const
+		{
+			return *name;
+		}
+
+		inline Json::StaticString StaticName() const
+		{
+			return Json::StaticString(name->c_str());
+		}
+	};
+
+	// 属性名驻留表
+	// 同一个属性名只会被保存一次，适合事件名称、属性名称这类取值有限的字符串
+	class ZhugePropertyKeys
+	{
+	private:
+		static ZhugePropertyKey Intern(const std::string& prefixed_name);
+	public:
+		// 系统属性，以$开头
+		static ZhugePropertyKey System(const std::string& property_name);
+
+		// 自定义属性，以_开头
+		static ZhugePropertyKey Custom(const std::string& property_name);
+
+		// 已经带有$或_前缀的属性名
+		static ZhugePropertyKey Prefixed(const std::string& prefixed_name);
+	};
+
+	// SDK内置的系统属性
+	extern const ZhugePropertyKey ZG_KEY_CUID;  // 用户ID
+	extern const ZhugePropertyKey ZG_KEY_EID;  // 事件名称
+	extern const ZhugePropertyKey ZG_KEY_SID;  // 会话ID
+	extern const ZhugePropertyKey ZG_KEY_TZ;  // 时区
+	extern const ZhugePropertyKey ZG_KEY_CT;  // 事件时间
+	extern const ZhugePropertyKey ZG_KEY_DRU;  // 时长
+	extern const ZhugePropertyKey ZG_KEY_LANG;  // 语言
+	extern const ZhugePropertyKey ZG_KEY_RS;  // 分辨率
+	extern const ZhugePropertyKey ZG_KEY_OS;  // 操作系统
+	extern const ZhugePropertyKey ZG_KEY_OV;  // 操作系统版本
+
+	class ZhugeSDK;
+
 	// 上传数据表示
 	class ZhugeSDKUploadData
 	{
 	private:
 		const char* const data_type;
 		Json::Value* data;
+		ZhugeSDK* owner;  // 提交数据的SDK对象，上传线程据此选择数据所属的租户
+		friend class ZhugeSDKTaskProcess;
+		ZhugeSDKUploadData(const ZhugeSDKUploadData&) = delete;
+		ZhugeSDKUploadData& operator=(const ZhugeSDKUploadData&) = delete;
+	protected:
+		// 移动构造函数，other中的数据被转移，之后不能再使用other
+		ZhugeSDKUploadData(ZhugeSDKUploadData&& other);
+
+		// 交换两个同类型对象的数据，不复制属性
+		void SwapData(ZhugeSDKUploadData& other);
+
+		// 清空所有属性，只保留数据类型，以便对象被重复使用
+		void ClearData();
 	public:
 		// 默认构造函数
 		ZhugeSDKUploadData(const char* const data_type);
@@ -230,8 +641,44 @@ namespace zhugeio
 			}
 		}
 
+		// 判断某个属性是否存在
+		bool HasProperty(const ZhugePropertyKey& key)
+		{
+			const std::string& name = key.Name();
+			return (*(this->data))["pr"].isMember(name.data(), name.data() + name.size());
+		}
+
+		// 获取某个属性的字符串值，如果不存在，则返回默认值
+		std::string GetStringProperty(const ZhugePropertyKey& key, std::string default_value)
+		{
+			const std::string& name = key.Name();
+			const Json::Value* value = (*(this->data))["pr"].find(name.data(), name.data() + name.size());
+			return value != nullptr ? value->asString() : default_value;
+		}
+
+		// 添加属性
+		template <typename PROP_TYPE>
+		void AddProperty(const ZhugePropertyKey& key, PROP_TYPE value)
+		{
+			(*(this->data))["pr"][key.StaticName()] = value;
+		}
+
+		// 如果属性不存在，则添加属性
+		template <typename PROP_TYPE>
+		void AddPropertyIfAbsent(const ZhugePropertyKey& key, PROP_TYPE value)
+		{
+			Json::Value& properties = (*(this->data))["pr"];
+			const std::string& name = key.Name();
+			if (!properties.isMember(name.data(), name.data() + name.size())) {
+				properties[key.StaticName()] = value;
+			}
+		}
+
 		virtual const Json::Value& GetJSONData();
 
+		// 将数据转移到target中，不复制属性，之后该对象只能被释放或者回收
+		void MoveJSONDataTo(Json::Value& target);
+
 		virtual std::string ToJSON();
 
 		// 析构函数
@@ -260,14 +707,177 @@ namespace zhugeio
 		virtual ~ZhugePlatform();
 	};
 
+	struct ZhugeCommonProperties;
+
+	// 被采样事件的追踪上下文，时间为std::chrono::steady_clock的纳秒数
+	struct ZhugeTraceContext
+	{
+		unsigned long long id = 0;  // 追踪ID，0为未采样
+		long long begin = 0;  // 调用Track的时间
+		long long enqueue = 0;  // 加入上传队列的时间
+	};
+
+	// 事件上报时的上下文
+	// 开启延迟填充时，Track只记录上下文，由上传线程根据上下文填充系统属性与公共属性
+	struct ZhugeTrackContext
+	{
+		bool deferred = false;
+		long long ct = 0;  // 上报时间
+		long long sid = 0;  // 上报时的会话ID
+		std::shared_ptr<const std::string> user_id;  // 上报时的用户ID，在序列化时才填充到事件中
+		std::shared_ptr<const ZhugeCommonProperties> common_properties;  // 上报时的公共属性快照
+		ZhugeTraceContext trace;
+	};
+
 	// 事件数据
 	class ZhugeEvent : public ZhugeSDKUploadData
 	{
+	private:
+		ZhugeTrackContext track_context;
+		ZhugeEvent();
+		friend class ZhugeEventPool;
+		friend class ZhugeSDK;
+		friend class ZhugeSDKTaskProcess;
 	public:
 		ZhugeEvent(const std::string& event_name);
+
+		// 移动构造函数，other中的属性被转移，之后不能再使用other
+		ZhugeEvent(ZhugeEvent&& other);
+
 		virtual ~ZhugeEvent();
 	};
 
+	// 批量上报的事件
+	// 整批事件作为一个元素进入任务队列，共用同一个上报上下文，由上传线程展开并填充属性
+	class ZhugeEventBatch : public ZhugeSDKUploadData
+	{
+	public:
+		std::vector<ZhugeEvent*> events;
+		ZhugeTrackContext context;
+
+		ZhugeEventBatch(std::vector<ZhugeEvent*> events);
+		virtual ~ZhugeEventBatch();
+	};
+
+	// Flush标记
+	// 与上传数据一起进入任务队列，上传线程处理到该标记时，之前入队的数据都已经写入本地存储，
+	// 在随后的上传周期结束时通知Flush的调用者
+	class ZhugeSDKFlushMarker : public ZhugeSDKUploadData
+	{
+	public:
+		std::promise<bool> promise;
+
+		ZhugeSDKFlushMarker();
+	};
+
+	// 事件对象池统计
+	struct ZhugeSDKPoolStats
+	{
+		unsigned long long allocated;  // 新创建的事件对象数
+		unsigned long long reused;  // 从池中重复使用的事件对象数
+		unsigned long long recycled;  // 回收到池中的事件对象数
+		unsigned long long freed;  // 因池已满而释放的事件对象数
+		size_t pooled;  // 当前全局空闲列表中的事件对象数，不含各线程的本地缓存
+	};
+
+	// 事件对象池
+	// 回收已经上传完毕的事件对象，供Track(ZhugeEvent&&)与NewEvent重复使用，减少堆内存分配。
+	// 每个线程为每个对象池持有一个本地缓存，取用对象时优先从本地缓存获取，缓存为空时从全局空闲列表批量补充；
+	// 上传线程通过ReleaseBatch一次性归还整批对象
+	class ZhugeEventPool
+	{
+	private:
+		std::vector<ZhugeEvent*> free_events;
+		const unsigned long long id;  // 区分各线程中属于该对象池的本地缓存
+		const size_t max_size;
+		std::mutex mutex;
+		std::atomic<unsigned long long> allocated;
+		std::atomic<unsigned long long> reused;
+		std::atomic<unsigned long long> recycled;
+		std::atomic<unsigned long long> freed;
+	public:
+		ZhugeEventPool(size_t max_size);
+
+		// 获取一个空的事件对象，池中没有空闲对象时创建新对象
+		ZhugeEvent* Acquire();
+
+		// 获取一个事件对象并设置事件名称
+		ZhugeEvent* Acquire(const std::string& event_name);
+
+		// 回收事件对象，优先放入当前线程的本地缓存
+		void Release(ZhugeEvent* event_ptr);
+
+		// 批量回收事件对象，只加锁一次，池已满时释放多余的对象
+		void ReleaseBatch(std::vector<ZhugeEvent*>& events);
+
+		ZhugeSDKPoolStats GetStats();
+
+		~ZhugeEventPool();
+	};
+
+	// 强类型事件定义
+	// 通过ZHUGE_EVENT或ZHUGE_NAMED_EVENT声明具有固定属性的事件类型，属性名在编译期加上_前缀，
+	// 并且每个属性名在进程中只驻留一次，上报时不再需要逐个构建属性名：
+	//
+	//   ZHUGE_NAMED_EVENT(AddCart, "加入购物车", (int, shopping_num), (std::string, sku))
+	//
+	//   AddCart event;
+	//   event.shopping_num = 1;
+	//   event.sku = "A-100";
+	//   zhugeio::zhuge_sdk->Track(event);
+	//
+	// 每个事件最多支持16个属性，属性类型中不能包含逗号
+#define ZHUGE_EVENT(event_type, ...) ZHUGE_NAMED_EVENT(event_type, #event_type, __VA_ARGS__)
+
+#define ZHUGE_NAMED_EVENT(event_type, event_name, ...) \
+	struct event_type \
+	{ \
+		typedef void ZhugeTypedEventTag; \
+		ZHUGE_PP_FOR_EACH(ZHUGE_EVENT_FIELD_DECLARE, __VA_ARGS__) \
+		static const char* EventName() \
+		{ \
+			return event_name; \
+		} \
+		void FillProperties(zhugeio::ZhugeSDKUploadData& data) const \
+		{ \
+			ZHUGE_PP_FOR_EACH(ZHUGE_EVENT_FIELD_FILL, __VA_ARGS__) \
+		} \
+	};
+
+#define ZHUGE_EVENT_FIELD_DECLARE(field) ZHUGE_EVENT_FIELD_DECLARE_I field
+#define ZHUGE_EVENT_FIELD_DECLARE_I(field_type, field_name) field_type field_name = field_type();
+
+#define ZHUGE_EVENT_FIELD_FILL(field) ZHUGE_EVENT_FIELD_FILL_I field
+#define ZHUGE_EVENT_FIELD_FILL_I(field_type, field_name) \
+	{ \
+		static const zhugeio::ZhugePropertyKey key = zhugeio::ZhugePropertyKeys::Prefixed("_" #field_name); \
+		data.AddProperty(key, this->field_name); \
+	}
+
+#define ZHUGE_PP_EXPAND(x) x
+#define ZHUGE_PP_CAT(a, b) ZHUGE_PP_CAT_I(a, b)
+#define ZHUGE_PP_CAT_I(a, b) a ## b
+#define ZHUGE_PP_NARGS(...) ZHUGE_PP_EXPAND(ZHUGE_PP_NARGS_I(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define ZHUGE_PP_NARGS_I(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define ZHUGE_PP_FOR_EACH(M, ...) \
+	ZHUGE_PP_EXPAND(ZHUGE_PP_CAT(ZHUGE_PP_FOR_EACH_, ZHUGE_PP_NARGS(__VA_ARGS__))(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_1(M, x) M(x)
+#define ZHUGE_PP_FOR_EACH_2(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_1(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_3(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_2(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_4(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_3(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_5(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_4(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_6(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_5(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_7(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_6(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_8(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_7(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_9(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_8(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_10(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_9(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_11(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_10(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_12(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_11(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_13(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_12(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_14(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_13(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_15(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_14(M, __VA_ARGS__))
+#define ZHUGE_PP_FOR_EACH_16(M, x, ...) M(x) ZHUGE_PP_EXPAND(ZHUGE_PP_FOR_EACH_15(M, __VA_ARGS__))
+
 	// 会话开始
 	class ZhugeSessionStart : public ZhugeSDKUploadData
 	{
@@ -348,6 +958,8 @@ namespace zhugeio
 		virtual void Save(std::string& data) = 0; // 保存上传数据到存储
 		virtual std::list<std::string>& Load() = 0;  // 加载保存的数据
 		virtual void Sync() = 0;  // 同步操作后的缓冲数据
+		virtual void Spill() = 0;  // 关闭时将未上传的数据写入磁盘
+		virtual bool Drained() = 0;  // 是否已经没有等待上传的数据，需要在Sync之前调用
 		virtual ~SDKDataStorage(){};
 	};
 
@@ -362,63 +974,446 @@ namespace zhugeio
 		virtual void Save(std::string& data);
 		virtual std::list<std::string>& Load();
 		virtual void Sync();
+		virtual void Spill();
+		virtual bool Drained();
+	};
+
+	// 数据文件段的索引信息
+	struct ZhugeStorageSegment
+	{
+		std::string name;  // 文件名
+		long long offset;  // 尚未上传的数据在文件中的开始位置，之前的数据都已经上传
+		long long size;  // 文件字节数
+		size_t lines;  // 文件中的批次总数，达到MaxStorageRecords之后不再追加
 	};
 
 	// 基于文件的SDK上传数据存储
+	// 数据目录中的manifest文件记录全部数据文件段及其上传进度，启动时只读取索引，段文件在读取时才检查是否存在；
+	// 没有索引或者要求修复时扫描一次数据目录，每次上传从最新的段中尚未上传的位置开始读取，上传成功后只推进段的上传位置
 	class FileSDKDataStorage : public SDKDataStorage
 	{
 	private:
 		std::list<std::string> buffer;
-		std::string last_read_file;
-		void GetFileList(std::set<std::string> &files);
+		std::vector<ZhugeStorageSegment> segments;  // 按创建时间排序，最后一个为最新的段
+		bool manifest_loaded;
+		bool manifest_dirty;
+		bool repair_pending;  // 需要扫描数据目录加入索引中没有的文件，扫描失败时在之后的周期重试
+		int loaded_segment;  // 本次上传周期读取的段，-1为没有读取
+		std::unordered_map<const std::string*, size_t> loaded_lines;  // 读取的批次在段中的序号
+		std::vector<long long> loaded_offsets;  // 读取的每个批次的开始位置，最后一个元素为读取的结束位置
+		bool GetFileList(std::set<std::string> &files);
+		bool AdoptDataFiles();
+		void LoadManifest();
+		void SaveManifest();
+		std::string NewSegmentName();
+		void SyncLoadedSegment(const std::vector<size_t>& kept_lines);
+		void AppendToSegments(const std::vector<const std::string*>& data);
 	public:
 		FileSDKDataStorage(ZhugeSDK* sdk);
 		virtual void Save(std::string& data);
 		virtual std::list<std::string>& Load();
 		virtual void Sync();
+		virtual void Spill();
+		virtual bool Drained();
+	};
+
+	// 上传节点健康状态
+	struct ZhugeSDKEndpointState
+	{
+		ZhugeSDKEndpoint endpoint;
+		double ewma_latency_ms;  // 请求延迟的指数加权移动平均
+		double error_rate;  // 请求失败率的指数加权移动平均
+		int consecutive_failures;  // 连续失败次数
+		long long retry_after;  // 熔断结束时间，steady_clock毫秒
+	};
+
+	// 上传节点选择器
+	// 根据EWMA延迟与错误率选择最优节点，连续失败的节点会被暂时摘除，直到冷却时间结束
+	class ZhugeSDKEndpointSelector
+	{
+	private:
+		std::vector<ZhugeSDKEndpointState> states;
+		const long long failure_latency_ms;  // 失败请求计入延迟的最小值
+		mutable std::mutex mutex;
+		double Score(const ZhugeSDKEndpointState& state);
+	public:
+		// failure_latency_ms为失败请求计入延迟平均值的最小值，通常为连接超时时间
+		ZhugeSDKEndpointSelector(const std::vector<ZhugeSDKEndpoint>& endpoints, long long failure_latency_ms);
+
+		// 选择一个不在excluded中的最优节点，返回节点下标，没有可用节点则返回-1
+		int Acquire(const std::set<int>& excluded);
+
+		// 根据请求结果更新节点的健康状态
+		void Release(int index, bool success, long long latency_ms);
+
+		inline size_t Size() const
+		{
+			return states.size();
+		}
+
+		inline const ZhugeSDKEndpoint& GetEndpoint(int index) const
+		{
+			return states[index].endpoint;
+		}
+	};
+
+	// 上传限速器
+	// 基于令牌桶，同时限制每秒上传字节数与每秒请求数，由所有上传请求共享
+	class ZhugeSDKRateLimiter
+	{
+	private:
+		const double bytes_per_second;
+		const double burst_bytes;
+		const double requests_per_second;
+		const double burst_requests;
+		double byte_tokens;
+		double request_tokens;
+		std::chrono::steady_clock::time_point last_refill;
+		bool cancelled;
+		std::mutex mutex;
+		std::condition_variable cond;
+	public:
+		ZhugeSDKRateLimiter(size_t bytes_per_second, size_t burst_bytes, double requests_per_second);
+
+		// 获取一次请求所需的令牌，令牌不足时阻塞到可以发送为止，被取消时立即返回
+		void Acquire(size_t bytes);
+
+		// 取消限速，唤醒正在等待的上传，之后不再等待；关闭时调用
+		void Cancel();
+	};
+
+	// TLS握手统计，未启用SSL时均为0
+	struct ZhugeSDKTLSStats
+	{
+		unsigned long long handshakes;  // 完成的握手总数
+		unsigned long long resumed_handshakes;  // 其中通过会话复用完成的简化握手数
+		unsigned long long handshake_microseconds;  // 握手总耗时，单位微秒
+	};
+
+	// 计数器分片数，每个线程固定使用其中一个分片
+	static const size_t ZHUGE_METRIC_SHARDS = 16;
+
+	// 获取当前线程使用的计数器分片
+	size_t ZhugeMetricShard();
+
+	// 计数器
+	// 按线程分片计数，每个分片独占一个缓存行，多个埋点线程同时计数时不会竞争同一个缓存行
+	class ZhugeSDKCounter
+	{
+	private:
+		struct Shard
+		{
+			std::atomic<unsigned long long> value;
+			char padding[64 - sizeof(std::atomic<unsigned long long>)];
+		};
+		Shard shards[ZHUGE_METRIC_SHARDS];
+	public:
+		ZhugeSDKCounter();
+
+		inline void Add(unsigned long long n)
+		{
+			this->shards[ZhugeMetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		// 汇总所有分片的计数
+		unsigned long long Value() const;
+	};
+
+	// 仪表，记录队列长度等可增可减的数值
+	class ZhugeSDKGauge
+	{
+	private:
+		std::atomic<long long> value;
+	public:
+		ZhugeSDKGauge();
+
+		inline void Add(long long n)
+		{
+			this->value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		inline void Set(long long n)
+		{
+			this->value.store(n, std::memory_order_relaxed);
+		}
+
+		inline long long Value() const
+		{
+			return this->value.load(std::memory_order_relaxed);
+		}
+	};
+
+	// 延迟直方图统计，单位纳秒，百分位数为所在区间的上界
+	struct ZhugeSDKHistogramStats
+	{
+		unsigned long long count;
+		unsigned long long sum;
+		unsigned long long max;
+		unsigned long long p50;
+		unsigned long long p90;
+		unsigned long long p99;
+		unsigned long long p999;
 	};
 
-	// 后台任务处理线程逻辑
+	// 直方图每个2的幂次区间等分的子区间数，相对误差不超过1/8
+	static const int ZHUGE_HISTOGRAM_SUB_BUCKETS = 8;
+	// 直方图区间数，可以记录的最大值约为4.8小时（2^44纳秒）
+	static const int ZHUGE_HISTOGRAM_BUCKETS = ZHUGE_HISTOGRAM_SUB_BUCKETS * 42;
+
+	// 延迟直方图
+	// 按2的幂次划分区间，每个区间再等分为子区间，记录一次延迟只需要几次原子操作，不需要加锁
+	class ZhugeSDKHistogram
+	{
+	private:
+		std::atomic<unsigned long long> buckets[ZHUGE_HISTOGRAM_BUCKETS];
+		std::atomic<unsigned long long> count;
+		std::atomic<unsigned long long> sum;
+		std::atomic<unsigned long long> max;
+		static int BucketIndex(unsigned long long value);
+		static unsigned long long BucketUpperBound(int index);
+	public:
+		ZhugeSDKHistogram();
+
+		// 记录一次延迟，单位纳秒
+		void Record(unsigned long long nanoseconds);
+
+		// 将记录累加到另一个直方图，用于汇总多个直方图
+		void AddTo(ZhugeSDKHistogram& total) const;
+
+		ZhugeSDKHistogramStats GetStats() const;
+	};
+
+	// SDK运行指标快照
+	struct ZhugeSDKStats
+	{
+		unsigned long long events_tracked;  // 提交的事件数
+		unsigned long long events_dropped;  // SDK暂停之后、超过队列配额或者因积压按优先级而被丢弃的事件数
+		unsigned long long events_sampled;  // 按事件采样率未被上报的事件数
+		long long queue_depth;  // 任务队列中等待序列化的数据数
+		unsigned long long batches_saved;  // 序列化之后保存到存储中的批次数
+		unsigned long long batches_dropped;  // 因超过存储上限而被丢弃的批次数
+		unsigned long long batches_uploaded;  // 上传成功的批次数
+		unsigned long long upload_requests;  // 上传请求数
+		unsigned long long upload_failures;  // 失败的上传请求数
+		unsigned long long bytes_sent;  // 上传请求体字节数
+		long long spool_batches;  // 存储中等待上传的批次数
+		long long spool_bytes;  // 存储中等待上传的字节数
+		ZhugeSDKHistogramStats track_latency;  // Track调用耗时，每个线程按1/64采样
+		ZhugeSDKHistogramStats serialize_latency;  // 每次序列化任务队列数据的耗时
+		ZhugeSDKHistogramStats upload_latency;  // 上传请求往返耗时
+		ZhugeSDKTLSStats tls;  // TLS握手统计
+		ZhugeSDKPoolStats pool;  // 事件对象池统计
+
+		std::string ToJSON() const;
+
+		// 转换为Prometheus文本格式，耗时单位为秒
+		std::string ToPrometheus() const;
+	};
+
+	// SDK指标注册表
+	class ZhugeSDKMetrics
+	{
+	public:
+		ZhugeSDKCounter events_tracked;
+		ZhugeSDKCounter events_dropped;
+		ZhugeSDKCounter events_sampled;
+		ZhugeSDKGauge queue_depth;
+		ZhugeSDKCounter batches_saved;
+		ZhugeSDKCounter batches_dropped;
+		ZhugeSDKCounter batches_uploaded;
+		ZhugeSDKCounter upload_requests;
+		ZhugeSDKCounter upload_failures;
+		ZhugeSDKCounter bytes_sent;
+		ZhugeSDKGauge spool_batches;
+		ZhugeSDKGauge spool_bytes;
+		ZhugeSDKHistogram track_latency;
+		ZhugeSDKHistogram serialize_latency;
+		ZhugeSDKHistogram upload_latency;
+	};
+
+	// Track耗时采样间隔，必须为2的幂
+	static const unsigned int ZHUGE_TRACK_LATENCY_SAMPLE_INTERVAL = 64;
+
+	class ZhugeSDKConnectionPool;
+	class ZhugeSDKMetricsServer;
+
+	// 平台属性
+	// 由上传线程根据队列中最近的平台数据生成，生成之后不再修改，序列化时引用到事件中
+	struct ZhugePlatformAttributes
+	{
+		Json::Value os;
+		Json::Value ov;
+	};
+
+	// 上传线程状态，只会按顺序向后转换
+	enum ZhugeSDKProcessState
+	{
+		ZHUGE_PROCESS_IDLE = 0,  // 尚未启动
+		ZHUGE_PROCESS_RUNNING,  // 按上传间隔运行
+		ZHUGE_PROCESS_DRAINING,  // 关闭中：将队列中剩余的数据写入存储，并在时间预算内上传
+		ZHUGE_PROCESS_SPILLING,  // 关闭中：将未上传的数据写入磁盘
+		ZHUGE_PROCESS_STOPPED  // 上传任务已经结束
+	};
+
+	struct ZhugeSDKProcessHandle;
+
+	// 后台任务处理逻辑
+	// 每个上传周期作为一个任务提交给执行器，周期结束后在上传间隔之后提交下一个周期
 	class ZhugeSDKTaskProcess
 	{
 	private:
 		ZhugeSDK* zhuge_sdk;
 		ZhugeSDKTaskQueue<ZhugeSDKUploadData*> upload_data_queue;  // 数据上传队列
 		SDKDataStorage* data_storage;
+		ZhugeSDKEndpointSelector endpoint_selector;
+		ZhugeSDKConnectionPool* connection_pool;
+		ZhugeSDKRateLimiter rate_limiter;
 		std::atomic<bool> stop_mark;
-		std::promise<void> shutdown_promise;
+		std::atomic<int> state;  // ZhugeSDKProcessState
+		std::atomic<long long> upload_deadline;  // 关闭时上传的截止时间，steady_clock毫秒，0为不限时间
+		std::shared_ptr<ZhugeSDKExecutor> executor;
+		std::shared_ptr<ZhugeSDKProcessHandle> handle;  // 执行器中的任务通过句柄访问该对象
+		unsigned long long cycle_generation;  // 上传周期序号，只在上传周期中或持有句柄的锁时访问，用于忽略被提前唤醒取代的定时任务
+		std::atomic<bool> wake_pending;  // 已经提交了立即执行的上传周期
+		std::mutex stop_mutex;
 		std::list<ZhugeSDKUploadData*> upload_data_buf;
-		void Process();
+		std::vector<ZhugeSDKFlushMarker*> flush_markers;  // 等待本周期上传结束的Flush标记
+
+		// 追踪状态，只在上传线程中访问
+		struct TracedBatch
+		{
+			unsigned long long batch_id;
+			long long saved;  // 写入本地存储的时间
+			bool sent;  // 是否已经尝试过上传
+		};
+		std::unordered_map<size_t, TracedBatch> traced_batches;  // 以批次内容的哈希值索引的被追踪批次
+		static void RunCycle(const std::shared_ptr<ZhugeSDKProcessHandle>& handle, unsigned long long generation);
+		void Drain();
 		void HandleUploadData();
-		void BuildFullUploadData(Json::Value& root);
-		void TransDataWithAPI();
+		void SerializeQueuedData();
+		void ResolveFlushMarkers(bool drained);
+		long long UploadBudgetMilliseconds();
+		void EnrichTracedEvent(ZhugeEvent* event_ptr, long long dequeue_time, std::vector<ZhugeTraceSpan>& event_spans);
+		void SaveBatch(
+			ZhugeSDK* owner, Json::Value& data, std::vector<ZhugeTraceSpan>& event_spans, Json::FastWriter& json_writer);
+		void TraceUpload(
+			std::list<std::string>::iterator begin, size_t frame_batches,
+			long long send_begin, long long send_end, const std::string& detail, bool uploaded);
+		void BuildFullUploadData(ZhugeSDK* owner, Json::Value& root);
+		size_t BuildUploadFrame(
+			std::list<std::string>& all_data, std::list<std::string>::iterator begin, std::string& frame);
+		bool TransDataWithAPI();
+		void UpdateSpoolMetrics(const std::list<std::string>& all_data);
 	public:
 		ZhugeSDKTaskProcess(ZhugeSDK* zhuge_sdk);
-		void AddUploadDataToQueue(ZhugeSDKUploadData* upload_data);
+		void AddUploadDataToQueue(ZhugeSDK* owner, ZhugeSDKUploadData* upload_data);
+		std::future<bool> Flush();
+		void Wake();
+		ZhugeSDKTLSStats GetTLSStats();
+		ZhugeSDKProcessState GetState();
 		void Run();
+
+		// 关闭上传任务：等待进行中的上传周期在时间预算的前4/5内结束，超时则中断进行中的请求，
+		// 再在调用者线程中上传剩余数据，最后将未上传的数据写入磁盘。
+		// 到时周期仍未结束则不再等待，由该周期结束时写入磁盘，析构时等待其结束
 		void Stop(int timeout);
+
+		// 关闭上传任务，不限制上传时间
 		void Stop();
 		~ZhugeSDKTaskProcess();
 	};
 
+	// 通用事件属性快照
+	// 属性名已经驻留为句柄，快照发布之后不再修改，可以被多个线程同时读取
+	// 与cuid、os、ov同名的属性排在最后，在SDK填充这些属性之后才填充，保持与直接填充时相同的优先级
+	struct ZhugeCommonProperties
+	{
+		std::vector<std::pair<ZhugePropertyKey, Json::Value>> properties;
+		size_t late_begin = 0;  // 第一个需要在cuid、os、ov之后填充的属性
+	};
+
 	struct TrackTimeHolder
 	{
 		ZhugeEvent* event_ptr;
 		const long long begin_time;
+		const long long steady_begin_time;  // 单调时钟开始时间，用于计算事件时长
+	};
+
+	// SDK时钟
+	// 精度大于0时由后台线程按精度刷新缓存的时间戳，读取时间戳只需要一次原子读取；
+	// 精度为0时每次直接读取系统时钟
+	class ZhugeSDKClock
+	{
+	private:
+		const int resolution_milliseconds;
+		std::atomic<long long> cached_milliseconds;  // 缓存的系统时间，毫秒
+		std::atomic<long long> cached_steady_milliseconds;  // 缓存的单调时间，毫秒
+		bool stop_mark;
+		std::mutex mutex;
+		std::condition_variable stop_cv;
+		std::thread tick_thread;
+		void Refresh();
+		void Tick();
+	public:
+		ZhugeSDKClock(int resolution_milliseconds);
+
+		// 当前系统时间，毫秒时间戳
+		inline long long Now() const
+		{
+			if (this->resolution_milliseconds > 0) {
+				return this->cached_milliseconds.load(std::memory_order_relaxed);
+			}
+			return std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		// 当前单调时间，毫秒，不受系统时间调整影响，只能用于计算时长
+		inline long long SteadyNow() const
+		{
+			if (this->resolution_milliseconds > 0) {
+				return this->cached_steady_milliseconds.load(std::memory_order_relaxed);
+			}
+			return std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// 使用同一个时间戳为一批数据设置事件时间，已经设置过事件时间的数据不受影响
+		void Stamp(const std::vector<ZhugeEvent*>& events);
+
+		~ZhugeSDKClock();
 	};
 
 	class ZhugeSDK
 	{
 	private:
 
+		// 租户所属的SDK对象，共用它的配置、上传线程、连接池、本地存储、时钟与事件对象池；
+		// 不是租户时为自身
+		ZhugeSDK* const host;
+
+		// 上传信封中的App key
+		const std::string app_key;
+
+		// 通过Tenant创建的租户，由当前SDK对象释放
+		std::unordered_map<std::string, ZhugeSDK*> tenants;
+
+		// 租户创建锁
+		std::mutex tenants_mutex;
+
+		// 已经入队尚未序列化的事件数，只在配置了MaxQueuedEvents时计数
+		std::atomic<size_t> queued_events;
+
+		// 最近一次上传的平台属性，只在上传线程中访问
+		std::shared_ptr<const ZhugePlatformAttributes> platform_attributes;
+
 		// 当前SDK是否已经被暂停
 		std::atomic<bool> stopped;
 
 		// 系统自动生成的设备ID
 		std::string auto_device_id;
 
-		// 当前用户ID
-		std::string user_id;
+		// 当前用户ID，通过std::atomic_store替换并增加context_version，没有用户时为空
+		std::shared_ptr<const std::string> user_id;
 
 		// 数据上传任务
 		ZhugeSDKTaskProcess* upload_process;
@@ -432,8 +1427,39 @@ namespace zhugeio
 		// 通用自定义属性
 		Json::Value common_custom_properties;
 
-		// 平台相关信息
-		ZhugePlatform* platform_info;
+		// 通用属性修改锁，只在设置通用属性时使用
+		mutable std::mutex common_properties_mutex;
+
+		// 当前发布的通用属性快照，通过std::atomic_store替换并增加context_version
+		std::shared_ptr<const ZhugeCommonProperties> common_properties;
+
+		// 用户ID与通用属性快照的版本，每次发布之后加1。
+		// std::atomic_load读取shared_ptr时会经过标准库的全局锁，Track在版本未变化时直接使用线程本地缓存的快照
+		std::atomic<unsigned long long> context_version;
+
+		// SDK对象的唯一序号，作为线程本地快照缓存的键；SDK对象的地址可能被之后创建的对象重用
+		unsigned long long instance_id;
+
+		// 基于当前的通用属性生成新的快照并发布
+		void PublishCommonProperties();
+
+		// 事件对象池
+		ZhugeEventPool event_pool;
+
+		// 事件时间戳时钟
+		ZhugeSDKClock clock;
+
+		// 运行指标
+		ZhugeSDKMetrics metrics;
+
+		// Prometheus指标接口，未开启时为空
+		ZhugeSDKMetricsServer* metrics_server;
+
+		// 日志输出，未开启日志时为空
+		std::shared_ptr<ZhugeSDKLogger> logger;
+
+		// 追踪ID序列，事件与批次共用
+		std::atomic<unsigned long long> trace_id_seq;
 
 		// 会话操作相关锁
 		mutable std::mutex session_mutex;
@@ -441,20 +1467,51 @@ namespace zhugeio
 		// 基于不同的平台，计算出不同的设备ID
 		std::string GenDeviceID();
 
-		// 填充公共属性
-		inline void FillCommonEventProperties(ZhugeSDKUploadData* data_ptr)
+		// 填充快照中[begin, end)范围内的公共属性
+		inline void FillCommonEventProperties(
+			ZhugeSDKUploadData* data_ptr, const ZhugeCommonProperties& snapshot, size_t begin, size_t end)
 		{
-			auto system_members = this->common_system_properties.getMemberNames();
-			for (auto member : system_members) {
-				data_ptr->AddSystemPropertyIfAbsent(member, common_system_properties[member]);
-			}
-
-			auto cus_members = this->common_custom_properties.getMemberNames();
-			for (auto member : cus_members) {
-				data_ptr->AddCustomPropertyIfAbsent(member, common_custom_properties[member]);
+			for (size_t i = begin; i < end; i++) {
+				data_ptr->AddPropertyIfAbsent<const Json::Value&>(snapshot.properties[i].first, snapshot.properties[i].second);
 			}
 		}
 
+		// 读取当前的事件时间、会话ID、用户ID与公共属性快照
+		void CaptureTrackContext(ZhugeTrackContext& context);
+
+		// 根据上下文填充事件属性，开启延迟填充时只记录上下文
+		void PrepareEvent(ZhugeEvent* event_ptr, const ZhugeTrackContext& context);
+
+		// 根据事件上报时的上下文依次填充用户ID、延迟填充的系统属性、操作系统信息与剩余的公共属性，并释放上下文
+		// 只在上传线程中调用
+		void EnrichEvent(ZhugeEvent* event_ptr);
+
+		// 释放被丢弃的事件对象，只有ZhugeEvent对象归还对象池，派生类型的对象直接删除
+		void DiscardEvents(std::vector<ZhugeEvent*>& events);
+
+		// 按优先级占用队列配额，超过MaxQueuedEvents或者低优先级事件遇到积压时返回false，关键事件总是返回true
+		bool AcquireQueueQuota(size_t events, ZhugeEventPriority priority);
+
+		// 根据事件名称的采样率与优先级判断是否接收事件，并占用队列配额；返回false时事件已经计入指标，需要被丢弃
+		bool AdmitEvent(const std::string& event_name);
+
+		// 同上，未配置事件策略时不读取事件对象中的事件名称
+		bool AdmitEvent(ZhugeEvent& event);
+
+		// 内存存储中等待上传的批次是否已经超过上限的一半
+		bool SpoolOverloaded();
+
+		// 填充并提交已经被接收的事件
+		void EnqueueEvent(ZhugeEvent* event_ptr);
+
+		// 创建租户
+		ZhugeSDK(ZhugeSDK* host, const std::string& app_key);
+
+		// 停止接收数据，包括全部租户
+		void StopAccepting();
+
+		friend class ZhugeSDKTaskProcess;
+
 	public:
 		// SDK配置
 		ZhugeSDKConfig* sdk_config;
@@ -465,9 +1522,21 @@ namespace zhugeio
 		// 初始化设备ID并启动后台处理进程
 		void StartProcess();
 
-		// 获取设备唯一ID
+		// 获取设备唯一ID，租户与所属的SDK对象使用同一个设备ID
 		const std::string& GetDeviceID();
 
+		// 获取上传信封中的App key
+		inline const std::string& GetAppKey() const
+		{
+			return this->app_key;
+		}
+
+		// 获取指定App key的租户，第一次获取时创建，需要在StartProcess之后调用。
+		// 租户与当前SDK对象共用上传线程、连接池与本地存储，只维护自己的用户、会话与公共属性，
+		// 上传时使用自己的App key，并且单独计算MaxQueuedEvents配额。
+		// 租户由当前SDK对象负责释放，当前SDK对象终止时租户也随之终止
+		ZhugeSDK* Tenant(const std::string& app_key);
+
 		// 设置通用的事件系统属性
 		void SetCommonEventSystemProperties(Json::Value& system_properties);
 
@@ -501,14 +1570,86 @@ namespace zhugeio
 		// 上传事件数据
 		void Track(ZhugeEvent* event_ptr);
 
+		// 批量上传事件数据，整批事件使用同一个上报上下文（事件时间、会话ID、用户ID与公共属性），
+		// 只入队一次，属性由上传线程填充。调用之后事件对象由SDK负责释放
+		void TrackBatch(std::vector<ZhugeEvent*> events);
+
+		// 上传事件数据，事件中的属性被转移到SDK内部的事件对象中，之后不能再使用event
+		void Track(ZhugeEvent&& event);
+
+		// 上传事件数据，由SDK接管事件对象
+		void Track(std::unique_ptr<ZhugeEvent> event_ptr);
+
+		// 从对象池中获取一个事件对象，通过Track(std::unique_ptr<ZhugeEvent>)上传之后会被回收
+		std::unique_ptr<ZhugeEvent> NewEvent(const std::string& event_name);
+
+		// 获取事件对象池统计
+		ZhugeSDKPoolStats GetPoolStats();
+
+		// 获取SDK时钟，可以通过Stamp为一批事件设置同一个事件时间
+		inline ZhugeSDKClock& GetClock()
+		{
+			return this->host->clock;
+		}
+
+		// 获取事件对象池
+		inline ZhugeEventPool& GetEventPool()
+		{
+			return this->host->event_pool;
+		}
+
+		// 上传通过ZHUGE_EVENT声明的强类型事件
+		template <typename EVENT>
+		void Track(const EVENT& typed_event, typename EVENT::ZhugeTypedEventTag* = nullptr)
+		{
+			if (this->stopped.load()) {  // SDK已经暂停
+				this->metrics.events_dropped.Add(1);
+				return;
+			}
+			static const std::string event_name(EVENT::EventName());  // 每个事件类型只构建一次事件名称
+			if (!this->AdmitEvent(event_name)) {  // 在取用对象池中的事件对象之前丢弃
+				return;
+			}
+			ZhugeEvent* event_ptr = this->GetEventPool().Acquire(event_name);
+			typed_event.FillProperties(*event_ptr);
+			this->EnqueueEvent(event_ptr);
+		}
+
 		// 开始事件计时
 		const TrackTimeHolder StartTrack(ZhugeEvent* event_ptr);
 
 		// 结束事件计时
 		void EndTrack(TrackTimeHolder& track_time_holder);
 
+		// 获取上传连接的TLS握手统计
+		ZhugeSDKTLSStats GetTLSStats();
+
+		// 获取SDK运行指标快照，包含TLS握手与事件对象池统计。
+		// 租户的提交与丢弃事件数、Track耗时只统计该租户，所属的SDK对象汇总自己与所有租户；其余为共用的上传线程的指标
+		ZhugeSDKStats GetStats();
+
+		// 获取运行指标注册表
+		inline ZhugeSDKMetrics& GetMetrics()
+		{
+			return this->metrics;
+		}
+
+		// 指定级别的日志是否需要输出
+		inline bool IsLogEnabled(ZhugeLogLevel level) const
+		{
+			return this->logger && this->sdk_config->enable_log && level >= this->sdk_config->log_level;
+		}
+
+		// 输出日志，超长的日志会被截断，suppressed为该位置之前因限速而被忽略的日志数
+		void Log(ZhugeLogLevel level, const std::string& message, unsigned long long suppressed = 0);
+
+		// 立即上传之前上报的全部数据，不等待上传间隔。
+		// 返回的future在这些数据都已经上传，或者上传失败并保留在本地存储中等待重试时就绪，
+		// 结果为本次上传之后本地存储中是否已经没有待上传的数据；SDK已经终止时结果为false
+		std::future<bool> Flush();
+
 		// 终止SDK执行
-		// 系统会执行Flush操作，并回收相关资源
+		// 系统会执行Flush操作，并回收相关资源；租户只停止接收数据，上传线程由所属的SDK对象终止
 		void Shutdown();
 
 		// 终止SDK执行，带有指定超时时间
@@ -525,6 +1666,9 @@ namespace zhugeio
 
 	void init_zhuge_sdk(ZhugeSDKConfig& zhuge_sdk_config);
 
+	// 立即上传全局默认SDK对象中的数据
+	std::future<bool> flush_zhuge_sdk();
+
 	// 关闭全局默认SDK对象
 	void shutdown_zhuge_sdk();
 
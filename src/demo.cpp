@@ -1,4 +1,6 @@
 ﻿#include <iostream>
+#include <chrono>
+#include <vector>
 #include "zhuge_sdk.h"
 
 
@@ -56,12 +58,29 @@ int main()
 	zhugeio::zhuge_sdk->SetCommonEventCustomProperties(common_properties);
 
 	// 事件属性上传
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 	for (int i = 0; i < 1000; i++) {
 		zhugeio::ZhugeEvent* event = new zhugeio::ZhugeEvent(zhugeio::GBK_TO_UTF8("Add_cart"));
 		event->AddCustomProperty(zhugeio::GBK_TO_UTF8("Shopping_num"), i);
 		event->AddCustomProperty("common_property_3", "4.0");
 		zhugeio::zhuge_sdk->Track(event);
 	}
+	const long long track_us = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - begin).count();
+
+	// 批量事件属性上传，整批事件只入队一次
+	begin = std::chrono::steady_clock::now();
+	std::vector<zhugeio::ZhugeEvent*> events;
+	for (int i = 0; i < 1000; i++) {
+		zhugeio::ZhugeEvent* batch_event = new zhugeio::ZhugeEvent(zhugeio::GBK_TO_UTF8("Add_cart"));
+		batch_event->AddCustomProperty(zhugeio::GBK_TO_UTF8("Shopping_num"), i);
+		batch_event->AddCustomProperty("common_property_3", "4.0");
+		events.push_back(batch_event);
+	}
+	zhugeio::zhuge_sdk->TrackBatch(std::move(events));
+	const long long track_batch_us = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - begin).count();
+	std::clog << "Track 1000 events: " << track_us << "us, TrackBatch 1000 events: " << track_batch_us << "us" << std::endl;
 
 	// 事件计时
 	zhugeio::ZhugeEvent* play_event = new zhugeio::ZhugeEvent(zhugeio::GBK_TO_UTF8("Play_video"));
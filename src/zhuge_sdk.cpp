@@ -6,14 +6,20 @@
 #include <thread>
 #include <chrono>
 #include <ctime>
+#include <algorithm>
 #include <exception>
 #include <set>
 #include <sstream>
+#include <iomanip>
+#include <typeinfo>
+#include <cerrno>
 #include "zhuge_sdk.h"
 
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #elif __APPLE__
 #include <IOKit/IOKitLib.h>
 #include <dirent.h>
@@ -26,10 +32,66 @@
 
 namespace zhugeio
 {
-	ZhugeSDKUploadData::ZhugeSDKUploadData(const char* const data_type) : data_type(data_type)
+	ZhugePropertyKey ZhugePropertyKeys::Intern(const std::string& prefixed_name)
+	{
+		// 驻留表不会被释放，保证句柄在进程退出阶段仍然有效
+		static std::mutex intern_mutex;
+		static std::set<std::string>* keys = new std::set<std::string>();
+		std::lock_guard<std::mutex> lock(intern_mutex);
+		return ZhugePropertyKey(&*(keys->insert(prefixed_name).first));
+	}
+
+	ZhugePropertyKey ZhugePropertyKeys::System(const std::string& property_name)
+	{
+		return Intern('$' + property_name);
+	}
+
+	ZhugePropertyKey ZhugePropertyKeys::Custom(const std::string& property_name)
+	{
+		return Intern('_' + property_name);
+	}
+
+	ZhugePropertyKey ZhugePropertyKeys::Prefixed(const std::string& prefixed_name)
+	{
+		return Intern(prefixed_name);
+	}
+
+	const ZhugePropertyKey ZG_KEY_CUID = ZhugePropertyKeys::System("cuid");
+	const ZhugePropertyKey ZG_KEY_EID = ZhugePropertyKeys::System("eid");
+	const ZhugePropertyKey ZG_KEY_SID = ZhugePropertyKeys::System("sid");
+	const ZhugePropertyKey ZG_KEY_TZ = ZhugePropertyKeys::System("tz");
+	const ZhugePropertyKey ZG_KEY_CT = ZhugePropertyKeys::System("ct");
+	const ZhugePropertyKey ZG_KEY_DRU = ZhugePropertyKeys::System("dru");
+	const ZhugePropertyKey ZG_KEY_LANG = ZhugePropertyKeys::System("lang");
+	const ZhugePropertyKey ZG_KEY_RS = ZhugePropertyKeys::System("rs");
+	const ZhugePropertyKey ZG_KEY_OS = ZhugePropertyKeys::System("os");
+	const ZhugePropertyKey ZG_KEY_OV = ZhugePropertyKeys::System("ov");
+
+	ZhugeSDKUploadData::ZhugeSDKUploadData(const char* const data_type) :
+		data_type(data_type),
+		owner(nullptr)
 	{
 		this->data = new Json::Value();
-		(*data)["dt"] = data_type;
+		(*data)[Json::StaticString("dt")] = Json::StaticString(data_type);
+	}
+
+	ZhugeSDKUploadData::ZhugeSDKUploadData(ZhugeSDKUploadData&& other) :
+		data_type(other.data_type),
+		data(other.data),
+		owner(nullptr)
+	{
+		other.data = nullptr;
+	}
+
+	void ZhugeSDKUploadData::SwapData(ZhugeSDKUploadData& other)
+	{
+		std::swap(this->data, other.data);
+	}
+
+	void ZhugeSDKUploadData::ClearData()
+	{
+		this->data->clear();
+		(*data)[Json::StaticString("dt")] = Json::StaticString(data_type);
 	}
 
 	bool ZhugeSDKUploadData::HasSystemProperty(const std::string& property_name)
@@ -47,6 +109,11 @@ namespace zhugeio
 		return *(this->data);
 	}
 
+	void ZhugeSDKUploadData::MoveJSONDataTo(Json::Value& target)
+	{
+		target.swap(*(this->data));
+	}
+
 	std::string ZhugeSDKUploadData::ToJSON()
 	{
 		return data->toStyledString();
@@ -61,7 +128,7 @@ namespace zhugeio
 	ZhugeUser::ZhugeUser(const std::string& user_id) : ZhugeSDKUploadData(ZG_USR)
 	{
 		this->user_id = user_id;
-		this->AddSystemProperty("cuid", user_id);
+		this->AddProperty(ZG_KEY_CUID, user_id);
 	}
 
 	ZhugeUser::~ZhugeUser()
@@ -71,7 +138,17 @@ namespace zhugeio
 
 	ZhugeEvent::ZhugeEvent(const std::string& event_name) : ZhugeSDKUploadData(ZG_EVT)
 	{
-		this->AddSystemProperty("eid", event_name);
+		this->AddProperty(ZG_KEY_EID, event_name);
+	}
+
+	ZhugeEvent::ZhugeEvent() : ZhugeSDKUploadData(ZG_EVT)
+	{
+
+	}
+
+	ZhugeEvent::ZhugeEvent(ZhugeEvent&& other) : ZhugeSDKUploadData(std::move(other))
+	{
+
 	}
 
 	ZhugeEvent::~ZhugeEvent()
@@ -81,7 +158,7 @@ namespace zhugeio
 
 	ZhugeSessionStart::ZhugeSessionStart(const long long sid) : ZhugeSDKUploadData(ZG_SS)
 	{
-		this->AddSystemProperty("sid", sid);
+		this->AddProperty(ZG_KEY_SID, sid);
 	}
 
 	ZhugeSessionStart::~ZhugeSessionStart()
@@ -91,7 +168,7 @@ namespace zhugeio
 
 	ZhugeSessionEnd::ZhugeSessionEnd(const long long sid) : ZhugeSDKUploadData(ZG_SE)
 	{
-		this->AddSystemProperty("sid", sid);
+		this->AddProperty(ZG_KEY_SID, sid);
 	}
 
 	ZhugeSessionEnd::~ZhugeSessionEnd()
@@ -99,6 +176,23 @@ namespace zhugeio
 
 	}
 
+	ZhugeEventBatch::ZhugeEventBatch(std::vector<ZhugeEvent*> events) :
+		ZhugeSDKUploadData(ZG_BATCH),
+		events(std::move(events))
+	{
+
+	}
+
+	ZhugeEventBatch::~ZhugeEventBatch()
+	{
+
+	}
+
+	ZhugeSDKFlushMarker::ZhugeSDKFlushMarker() : ZhugeSDKUploadData(ZG_FLUSH)
+	{
+
+	}
+
 	ZhugePlatform::ZhugePlatform() : ZhugeSDKUploadData(ZG_PL)
 	{
 
@@ -109,6 +203,797 @@ namespace zhugeio
 
 	}
 
+	// 线程本地的空闲事件对象缓存，按对象池分别缓存，使每个对象池的统计与上限只包含自己的对象；线程退出时释放
+	struct ZhugeEventThreadCache
+	{
+		struct Entry
+		{
+			unsigned long long pool_id;
+			std::vector<ZhugeEvent*> events;
+		};
+		std::vector<Entry> entries;  // 一个进程中的对象池通常只有一个，顺序查找即可
+
+		// 获取对象池在当前线程的缓存
+		std::vector<ZhugeEvent*>& Of(unsigned long long pool_id)
+		{
+			for (auto& entry : this->entries) {
+				if (entry.pool_id == pool_id) {
+					return entry.events;
+				}
+			}
+			this->entries.push_back(Entry());
+			this->entries.back().pool_id = pool_id;
+			this->entries.back().events.reserve(DEFAULT_EVENT_THREAD_CACHE_SIZE);
+			return this->entries.back().events;
+		}
+
+		// 释放对象池在当前线程的缓存
+		void Remove(unsigned long long pool_id)
+		{
+			for (auto itr = this->entries.begin(); itr != this->entries.end(); ++itr) {
+				if (itr->pool_id == pool_id) {
+					for (auto event_ptr : itr->events) {
+						delete event_ptr;
+					}
+					this->entries.erase(itr);
+					return;
+				}
+			}
+		}
+
+		~ZhugeEventThreadCache()
+		{
+			for (auto& entry : this->entries) {
+				for (auto event_ptr : entry.events) {
+					delete event_ptr;
+				}
+			}
+		}
+	};
+
+	thread_local ZhugeEventThreadCache event_thread_cache;
+
+	// 对象池ID序列，对象池释放后地址可能被重用，因此不以地址区分线程缓存
+	static std::atomic<unsigned long long> event_pool_id_seq(0);
+
+	ZhugeEventPool::ZhugeEventPool(size_t max_size) :
+		id(++event_pool_id_seq),
+		max_size(max_size)
+	{
+		this->allocated.store(0);
+		this->reused.store(0);
+		this->recycled.store(0);
+		this->freed.store(0);
+	}
+
+	ZhugeEvent* ZhugeEventPool::Acquire()
+	{
+		std::vector<ZhugeEvent*>& cache = event_thread_cache.Of(this->id);
+		if (cache.empty()) {  // 从全局空闲列表批量补充本地缓存
+			std::lock_guard<std::mutex> lock(this->mutex);
+			const size_t n = std::min(this->free_events.size(), DEFAULT_EVENT_THREAD_CACHE_SIZE / 2);
+			cache.insert(cache.end(), this->free_events.end() - n, this->free_events.end());
+			this->free_events.resize(this->free_events.size() - n);
+		}
+		if (!cache.empty()) {
+			ZhugeEvent* event_ptr = cache.back();
+			cache.pop_back();
+			this->reused++;
+			return event_ptr;
+		}
+		this->allocated++;
+		return new ZhugeEvent();
+	}
+
+	ZhugeEvent* ZhugeEventPool::Acquire(const std::string& event_name)
+	{
+		ZhugeEvent* event_ptr = this->Acquire();
+		event_ptr->AddProperty(ZG_KEY_EID, event_name);
+		return event_ptr;
+	}
+
+	void ZhugeEventPool::Release(ZhugeEvent* event_ptr)
+	{
+		std::vector<ZhugeEvent*>& cache = event_thread_cache.Of(this->id);
+		if (cache.size() < DEFAULT_EVENT_THREAD_CACHE_SIZE) {
+			event_ptr->ClearData();
+			cache.push_back(event_ptr);
+			this->recycled++;
+			return;
+		}
+		std::vector<ZhugeEvent*> events(1, event_ptr);
+		this->ReleaseBatch(events);
+	}
+
+	void ZhugeEventPool::ReleaseBatch(std::vector<ZhugeEvent*>& events)
+	{
+		for (auto event_ptr : events) {  // 在锁外清理属性
+			event_ptr->ClearData();
+		}
+
+		size_t n;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			n = std::min(events.size(), this->max_size - std::min(this->max_size, this->free_events.size()));
+			this->free_events.insert(this->free_events.end(), events.begin(), events.begin() + n);
+		}
+		for (size_t i = n; i < events.size(); i++) {
+			delete events[i];
+		}
+		this->recycled += n;
+		this->freed += events.size() - n;
+		events.clear();
+	}
+
+	ZhugeSDKPoolStats ZhugeEventPool::GetStats()
+	{
+		ZhugeSDKPoolStats stats;
+		stats.allocated = this->allocated.load();
+		stats.reused = this->reused.load();
+		stats.recycled = this->recycled.load();
+		stats.freed = this->freed.load();
+		std::lock_guard<std::mutex> lock(this->mutex);
+		stats.pooled = this->free_events.size();
+		return stats;
+	}
+
+	ZhugeEventPool::~ZhugeEventPool()
+	{
+		for (auto event_ptr : this->free_events) {
+			delete event_ptr;
+		}
+		event_thread_cache.Remove(this->id);  // 其它线程中的缓存在线程退出时释放
+	}
+
+	// 日志实现
+
+	static const char* ZhugeLogLevelName(ZhugeLogLevel level)
+	{
+		switch (level) {
+		case ZHUGE_LOG_DEBUG:
+			return "DEBUG";
+		case ZHUGE_LOG_INFO:
+			return "INFO";
+		case ZHUGE_LOG_WARN:
+			return "WARN";
+		default:
+			return "ERROR";
+		}
+	}
+
+	ZhugeSDKAsyncLogger::ZhugeSDKAsyncLogger(std::ostream& out, size_t capacity) :
+		dequeue_pos(0),
+		out(out),
+		stop_mark(false)
+	{
+		size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		this->slots.reset(new Slot[size]);
+		this->mask = size - 1;
+		for (size_t i = 0; i < size; i++) {
+			this->slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		this->enqueue_pos.store(0);
+		this->dropped.store(0);
+		this->writer_thread = std::thread([this]{ this->Write(); });
+	}
+
+	void ZhugeSDKAsyncLogger::Log(ZhugeLogLevel level, const std::string& message)
+	{
+		// 有界无锁队列：通过CAS占用一个槽位，写入之后更新槽位序号通知输出线程
+		size_t pos = this->enqueue_pos.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true) {
+			slot = &this->slots[pos & this->mask];
+			const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			const long long diff = static_cast<long long>(sequence) - static_cast<long long>(pos);
+			if (diff == 0) {
+				if (this->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {  // 缓冲区已满
+				this->dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else {
+				pos = this->enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		slot->level = level;
+		slot->message = message;
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		this->cond.notify_one();
+	}
+
+	bool ZhugeSDKAsyncLogger::Dequeue(ZhugeLogLevel& level, std::string& message)
+	{
+		Slot& slot = this->slots[this->dequeue_pos & this->mask];
+		if (slot.sequence.load(std::memory_order_acquire) != this->dequeue_pos + 1) {
+			return false;
+		}
+		level = slot.level;
+		message.swap(slot.message);
+		slot.sequence.store(this->dequeue_pos + this->mask + 1, std::memory_order_release);
+		this->dequeue_pos++;
+		return true;
+	}
+
+	void ZhugeSDKAsyncLogger::Write()
+	{
+		std::string buffer;
+		std::string message;
+		ZhugeLogLevel level;
+		unsigned long long reported_dropped = 0;
+		while (true) {
+			bool stopping;
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				stopping = this->stop_mark;
+			}
+
+			// 取出缓冲区中的全部日志，一次写入输出流
+			buffer.clear();
+			while (this->Dequeue(level, message)) {
+				buffer.append("[ZhugeSDK] [").append(ZhugeLogLevelName(level)).append("] ").append(message).append("\n");
+			}
+			const unsigned long long dropped = this->dropped.load(std::memory_order_relaxed);
+			if (dropped != reported_dropped) {
+				buffer.append("[ZhugeSDK] [WARN] ").append(std::to_string(dropped - reported_dropped))
+					.append(" log messages dropped\n");
+				reported_dropped = dropped;
+			}
+			if (!buffer.empty()) {
+				this->out << buffer;
+				this->out.flush();
+			}
+
+			if (stopping) {
+				break;
+			}
+			// 通知可能在进入等待之前发生，因此最多等待100毫秒之后重新检查
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->cond.wait_for(lock, std::chrono::milliseconds(100));
+		}
+	}
+
+	unsigned long long ZhugeSDKAsyncLogger::GetDropped() const
+	{
+		return this->dropped.load(std::memory_order_relaxed);
+	}
+
+	ZhugeSDKAsyncLogger::~ZhugeSDKAsyncLogger()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stop_mark = true;
+		}
+		this->cond.notify_one();
+		this->writer_thread.join();
+	}
+
+	// 每个日志输出位置的限速状态，按秒计数
+	struct ZhugeLogRateLimit
+	{
+		std::atomic<long long> window;  // 当前计数的秒数
+		std::atomic<int> count;  // 当前一秒内输出的日志数
+		std::atomic<unsigned long long> suppressed;  // 被忽略且尚未报告的日志数
+
+		ZhugeLogRateLimit()
+		{
+			this->window.store(0);
+			this->count.store(0);
+			this->suppressed.store(0);
+		}
+
+		bool Allow(int max_per_second, unsigned long long& reported_suppressed)
+		{
+			if (max_per_second > 0) {
+				const long long now = std::chrono::duration_cast<std::chrono::seconds>(
+					std::chrono::steady_clock::now().time_since_epoch()).count();
+				long long window = this->window.load(std::memory_order_relaxed);
+				if (window != now && this->window.compare_exchange_strong(window, now)) {
+					this->count.store(0);
+				}
+				if (this->count.fetch_add(1) >= max_per_second) {
+					this->suppressed.fetch_add(1);
+					return false;
+				}
+			}
+			reported_suppressed = this->suppressed.exchange(0);
+			return true;
+		}
+	};
+
+	// 输出一条SDK日志，日志未开启时不会格式化消息，每个调用位置单独限速
+#define ZHUGE_LOG(sdk, level, message) \
+	do { \
+		if ((sdk)->IsLogEnabled(level)) { \
+			static ZhugeLogRateLimit zhuge_log_rate_limit; \
+			unsigned long long zhuge_log_suppressed = 0; \
+			if (zhuge_log_rate_limit.Allow((sdk)->sdk_config->max_log_messages_per_second, zhuge_log_suppressed)) { \
+				std::ostringstream zhuge_log_stream; \
+				zhuge_log_stream << message; \
+				(sdk)->Log(level, zhuge_log_stream.str(), zhuge_log_suppressed); \
+			} \
+		} \
+	} while (0)
+
+	// 追踪实现
+
+	// 未上传的被追踪批次的数目上限，批次可能因存储已满被删除而不再上传，超出上限时清空
+	static const size_t ZHUGE_TRACE_MAX_PENDING_BATCHES = 4096;
+
+	static long long ZhugeTraceNow()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	const char* ZhugeTraceStageName(ZhugeTraceStage stage)
+	{
+		switch (stage) {
+		case ZHUGE_TRACE_TRACK:
+			return "track";
+		case ZHUGE_TRACE_QUEUE_WAIT:
+			return "queue_wait";
+		case ZHUGE_TRACE_ENRICH:
+			return "enrich";
+		case ZHUGE_TRACE_SERIALIZE:
+			return "serialize";
+		case ZHUGE_TRACE_SAVE:
+			return "save";
+		case ZHUGE_TRACE_SPOOL_WAIT:
+			return "spool_wait";
+		case ZHUGE_TRACE_SEND:
+			return "send";
+		default:
+			return "ack";
+		}
+	}
+
+	ZhugeSDKChromeTraceWriter::ZhugeSDKChromeTraceWriter(const std::string& path) :
+		out(path.c_str(), std::ios::out | std::ios::trunc)
+	{
+		// 为事件与批次两类记录命名
+		this->out
+			<< "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"events\"}}"
+			<< ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"batches\"}}";
+	}
+
+	void ZhugeSDKChromeTraceWriter::Record(const ZhugeTraceSpan& span)
+	{
+		// 事件记录按追踪ID分行，批次记录按批次ID分行；时间单位为微秒
+		const bool event_span = span.trace_id != 0;
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(3)
+			<< ",\n{\"name\":\"" << ZhugeTraceStageName(span.stage) << "\",\"cat\":\"zhuge\""
+			<< ",\"pid\":" << (event_span ? 1 : 2)
+			<< ",\"tid\":" << (event_span ? span.trace_id : span.batch_id)
+			<< ",\"ts\":" << span.begin / 1000.0;
+		if (span.stage == ZHUGE_TRACE_ACK) {
+			line << ",\"ph\":\"i\",\"s\":\"t\"";
+		}
+		else {
+			line << ",\"ph\":\"X\",\"dur\":" << (span.end - span.begin) / 1000.0;
+		}
+		line << ",\"args\":{\"trace_id\":" << span.trace_id
+			<< ",\"batch_id\":" << span.batch_id
+			<< ",\"detail\":" << Json::valueToQuotedString(span.detail.c_str()) << "}}";
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->out << line.str();
+	}
+
+	ZhugeSDKChromeTraceWriter::~ZhugeSDKChromeTraceWriter()
+	{
+		this->out << "\n]\n";
+	}
+
+	// 线程池实现
+
+	// 当前线程所属的线程池与工作线程序号，不是工作线程时为空
+	thread_local ZhugeSDKWorkerPool* current_worker_pool = nullptr;
+	thread_local size_t current_worker_index = 0;
+
+	ZhugeSDKWorkerPool::ZhugeSDKWorkerPool(size_t threads) :
+		pending(0),
+		stop_mark(false)
+	{
+		this->next_worker.store(0);
+		const size_t n = std::max<size_t>(1, threads);
+		for (size_t i = 0; i < n; i++) {
+			this->workers.push_back(std::unique_ptr<Worker>(new Worker()));
+		}
+		for (size_t i = 0; i < n; i++) {  // 全部队列创建之后再启动线程，窃取任务时会访问其它队列
+			this->workers[i]->thread = std::thread([this, i]{ this->Work(i); });
+		}
+	}
+
+	void ZhugeSDKWorkerPool::Execute(std::function<void()> task)
+	{
+		// 工作线程提交的任务放入自己的队列，其它线程提交的任务轮流放入各个队列
+		const size_t index = current_worker_pool == this ? current_worker_index :
+			this->next_worker.fetch_add(1, std::memory_order_relaxed) % this->workers.size();
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->pending++;  // 先于入队计数，取出任务时计数不会小于0
+		}
+		{
+			std::lock_guard<std::mutex> lock(this->workers[index]->mutex);
+			this->workers[index]->tasks.push_back(std::move(task));
+		}
+		this->cond.notify_one();
+	}
+
+	void ZhugeSDKWorkerPool::ExecuteAfter(long long delay_milliseconds, std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->timers.insert(std::make_pair(
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_milliseconds), std::move(task)));
+		}
+		this->cond.notify_one();  // 新任务可能早于等待中的线程的唤醒时间
+	}
+
+	bool ZhugeSDKWorkerPool::Take(size_t index, std::function<void()>& task)
+	{
+		const size_t n = this->workers.size();
+		for (size_t i = 0; i < n; i++) {
+			Worker& worker = *this->workers[(index + i) % n];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			if (worker.tasks.empty()) {
+				continue;
+			}
+			if (i == 0) {  // 自己的队列按提交顺序执行
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			else {  // 从其它队列的尾部窃取
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void ZhugeSDKWorkerPool::Work(size_t index)
+	{
+		current_worker_pool = this;
+		current_worker_index = index;
+		std::function<void()> task;
+		while (true) {
+			if (this->Take(index, task)) {
+				{
+					std::lock_guard<std::mutex> lock(this->mutex);
+					this->pending--;
+				}
+				task();
+				task = nullptr;
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(this->mutex);
+			if (this->stop_mark) {
+				return;
+			}
+			if (!this->timers.empty() && this->timers.begin()->first <= std::chrono::steady_clock::now()) {
+				task = std::move(this->timers.begin()->second);  // 执行到期的延迟任务
+				this->timers.erase(this->timers.begin());
+				lock.unlock();
+				task();
+				task = nullptr;
+				continue;
+			}
+			if (this->pending > 0) {  // 任务已经计数，正在入队
+				continue;
+			}
+			if (this->timers.empty()) {
+				this->cond.wait(lock);
+			}
+			else {
+				const std::chrono::steady_clock::time_point due = this->timers.begin()->first;  // 等待期间任务可能被其它线程取出
+				this->cond.wait_until(lock, due);
+			}
+		}
+	}
+
+	ZhugeSDKWorkerPool::~ZhugeSDKWorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stop_mark = true;
+		}
+		this->cond.notify_all();
+		for (auto& worker : this->workers) {
+			worker->thread.join();
+		}
+	}
+
+	// 指标实现
+
+	size_t ZhugeMetricShard()
+	{
+		static std::atomic<size_t> next_shard(0);
+		thread_local size_t shard = next_shard.fetch_add(1) % ZHUGE_METRIC_SHARDS;
+		return shard;
+	}
+
+	ZhugeSDKCounter::ZhugeSDKCounter()
+	{
+		for (auto& shard : this->shards) {
+			shard.value.store(0);
+		}
+	}
+
+	unsigned long long ZhugeSDKCounter::Value() const
+	{
+		unsigned long long value = 0;
+		for (auto& shard : this->shards) {
+			value += shard.value.load(std::memory_order_relaxed);
+		}
+		return value;
+	}
+
+	ZhugeSDKGauge::ZhugeSDKGauge()
+	{
+		this->value.store(0);
+	}
+
+	ZhugeSDKHistogram::ZhugeSDKHistogram()
+	{
+		for (auto& bucket : this->buckets) {
+			bucket.store(0);
+		}
+		this->count.store(0);
+		this->sum.store(0);
+		this->max.store(0);
+	}
+
+	int ZhugeSDKHistogram::BucketIndex(unsigned long long value)
+	{
+		if (value < ZHUGE_HISTOGRAM_SUB_BUCKETS) {
+			return static_cast<int>(value);
+		}
+		int exponent = 3;  // value的最高位，子区间占用最高位之后的3位
+		while (exponent < 43 && (value >> (exponent + 1)) != 0) {
+			exponent++;
+		}
+		if ((value >> (exponent + 1)) != 0) {  // 超出记录范围，计入最后一个区间
+			return ZHUGE_HISTOGRAM_BUCKETS - 1;
+		}
+		const int sub_bucket = static_cast<int>((value >> (exponent - 3)) & (ZHUGE_HISTOGRAM_SUB_BUCKETS - 1));
+		return (exponent - 2) * ZHUGE_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+	}
+
+	unsigned long long ZhugeSDKHistogram::BucketUpperBound(int index)
+	{
+		if (index < ZHUGE_HISTOGRAM_SUB_BUCKETS) {
+			return index;
+		}
+		const int exponent = index / ZHUGE_HISTOGRAM_SUB_BUCKETS + 2;
+		const unsigned long long sub_bucket = index % ZHUGE_HISTOGRAM_SUB_BUCKETS;
+		return ((ZHUGE_HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - 3)) - 1;
+	}
+
+	void ZhugeSDKHistogram::Record(unsigned long long nanoseconds)
+	{
+		this->buckets[BucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		this->count.fetch_add(1, std::memory_order_relaxed);
+		this->sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+		unsigned long long current_max = this->max.load(std::memory_order_relaxed);
+		while (nanoseconds > current_max &&
+			!this->max.compare_exchange_weak(current_max, nanoseconds, std::memory_order_relaxed)) {
+		}
+	}
+
+	void ZhugeSDKHistogram::AddTo(ZhugeSDKHistogram& total) const
+	{
+		for (int i = 0; i < ZHUGE_HISTOGRAM_BUCKETS; i++) {
+			total.buckets[i].fetch_add(this->buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+		total.count.fetch_add(this->count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		total.sum.fetch_add(this->sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		const unsigned long long max = this->max.load(std::memory_order_relaxed);
+		if (max > total.max.load(std::memory_order_relaxed)) {
+			total.max.store(max, std::memory_order_relaxed);
+		}
+	}
+
+	ZhugeSDKHistogramStats ZhugeSDKHistogram::GetStats() const
+	{
+		ZhugeSDKHistogramStats stats = {};
+		unsigned long long counts[ZHUGE_HISTOGRAM_BUCKETS];
+		unsigned long long total = 0;
+		for (int i = 0; i < ZHUGE_HISTOGRAM_BUCKETS; i++) {
+			counts[i] = this->buckets[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+		stats.count = total;
+		stats.sum = this->sum.load(std::memory_order_relaxed);
+		stats.max = this->max.load(std::memory_order_relaxed);
+		if (total == 0) {
+			return stats;
+		}
+
+		// 依次找到累计数目达到各个百分位的区间
+		const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+		unsigned long long* results[] = { &stats.p50, &stats.p90, &stats.p99, &stats.p999 };
+		unsigned long long cumulative = 0;
+		int p = 0;
+		for (int i = 0; i < ZHUGE_HISTOGRAM_BUCKETS && p < 4; i++) {
+			cumulative += counts[i];
+			while (p < 4 && cumulative >= percentiles[p] * total) {
+				*results[p++] = std::min(BucketUpperBound(i), stats.max);
+			}
+		}
+		return stats;
+	}
+
+	// 将直方图统计转换为JSON，单位微秒，不足1微秒的部分被舍去
+	static Json::Value HistogramStatsToJSON(const ZhugeSDKHistogramStats& stats)
+	{
+		Json::Value value;
+		value["count"] = static_cast<Json::UInt64>(stats.count);
+		value["sum_us"] = static_cast<Json::UInt64>(stats.sum / 1000);
+		value["max_us"] = static_cast<Json::UInt64>(stats.max / 1000);
+		value["p50_us"] = static_cast<Json::UInt64>(stats.p50 / 1000);
+		value["p90_us"] = static_cast<Json::UInt64>(stats.p90 / 1000);
+		value["p99_us"] = static_cast<Json::UInt64>(stats.p99 / 1000);
+		value["p999_us"] = static_cast<Json::UInt64>(stats.p999 / 1000);
+		return value;
+	}
+
+	std::string ZhugeSDKStats::ToJSON() const
+	{
+		Json::Value root;
+		root["events_tracked"] = static_cast<Json::UInt64>(this->events_tracked);
+		root["events_dropped"] = static_cast<Json::UInt64>(this->events_dropped);
+		root["events_sampled"] = static_cast<Json::UInt64>(this->events_sampled);
+		root["queue_depth"] = static_cast<Json::Int64>(this->queue_depth);
+		root["batches_saved"] = static_cast<Json::UInt64>(this->batches_saved);
+		root["batches_dropped"] = static_cast<Json::UInt64>(this->batches_dropped);
+		root["batches_uploaded"] = static_cast<Json::UInt64>(this->batches_uploaded);
+		root["upload_requests"] = static_cast<Json::UInt64>(this->upload_requests);
+		root["upload_failures"] = static_cast<Json::UInt64>(this->upload_failures);
+		root["bytes_sent"] = static_cast<Json::UInt64>(this->bytes_sent);
+		root["spool_batches"] = static_cast<Json::Int64>(this->spool_batches);
+		root["spool_bytes"] = static_cast<Json::Int64>(this->spool_bytes);
+		root["track_latency"] = HistogramStatsToJSON(this->track_latency);
+		root["serialize_latency"] = HistogramStatsToJSON(this->serialize_latency);
+		root["upload_latency"] = HistogramStatsToJSON(this->upload_latency);
+		root["tls"]["handshakes"] = static_cast<Json::UInt64>(this->tls.handshakes);
+		root["tls"]["resumed_handshakes"] = static_cast<Json::UInt64>(this->tls.resumed_handshakes);
+		root["tls"]["handshake_us"] = static_cast<Json::UInt64>(this->tls.handshake_microseconds);
+		root["pool"]["allocated"] = static_cast<Json::UInt64>(this->pool.allocated);
+		root["pool"]["reused"] = static_cast<Json::UInt64>(this->pool.reused);
+		root["pool"]["recycled"] = static_cast<Json::UInt64>(this->pool.recycled);
+		root["pool"]["freed"] = static_cast<Json::UInt64>(this->pool.freed);
+		root["pool"]["pooled"] = static_cast<Json::UInt64>(this->pool.pooled);
+		return root.toStyledString();
+	}
+
+	// 输出一个Prometheus指标
+	template <typename VALUE_TYPE>
+	static void WritePrometheusMetric(std::ostringstream& out,
+		const char* name, const char* type, const char* help, VALUE_TYPE value)
+	{
+		out << "# HELP " << name << " " << help << "\n"
+			<< "# TYPE " << name << " " << type << "\n"
+			<< name << " " << value << "\n";
+	}
+
+	// 以summary类型输出直方图统计，单位秒
+	static void WritePrometheusSummary(std::ostringstream& out,
+		const char* name, const char* help, const ZhugeSDKHistogramStats& stats)
+	{
+		out << "# HELP " << name << " " << help << "\n"
+			<< "# TYPE " << name << " summary\n"
+			<< name << "{quantile=\"0.5\"} " << stats.p50 / 1e9 << "\n"
+			<< name << "{quantile=\"0.9\"} " << stats.p90 / 1e9 << "\n"
+			<< name << "{quantile=\"0.99\"} " << stats.p99 / 1e9 << "\n"
+			<< name << "{quantile=\"0.999\"} " << stats.p999 / 1e9 << "\n"
+			<< name << "_sum " << stats.sum / 1e9 << "\n"
+			<< name << "_count " << stats.count << "\n";
+	}
+
+	std::string ZhugeSDKStats::ToPrometheus() const
+	{
+		std::ostringstream out;
+		WritePrometheusMetric(out, "zhuge_sdk_events_tracked_total", "counter",
+			"Events submitted through Track.", this->events_tracked);
+		WritePrometheusMetric(out, "zhuge_sdk_events_dropped_total", "counter",
+			"Events dropped because the SDK was stopped, the queue quota was exceeded or the backlog shed them by priority.",
+			this->events_dropped);
+		WritePrometheusMetric(out, "zhuge_sdk_events_sampled_total", "counter",
+			"Events not submitted because of the per-event sample rate.", this->events_sampled);
+		WritePrometheusMetric(out, "zhuge_sdk_queue_depth", "gauge",
+			"Items waiting in the task queue.", this->queue_depth);
+		WritePrometheusMetric(out, "zhuge_sdk_batches_saved_total", "counter",
+			"Batches serialized into storage.", this->batches_saved);
+		WritePrometheusMetric(out, "zhuge_sdk_batches_dropped_total", "counter",
+			"Batches dropped because storage was full.", this->batches_dropped);
+		WritePrometheusMetric(out, "zhuge_sdk_batches_uploaded_total", "counter",
+			"Batches uploaded successfully.", this->batches_uploaded);
+		WritePrometheusMetric(out, "zhuge_sdk_upload_requests_total", "counter",
+			"Upload requests sent.", this->upload_requests);
+		WritePrometheusMetric(out, "zhuge_sdk_upload_failures_total", "counter",
+			"Upload requests that failed.", this->upload_failures);
+		WritePrometheusMetric(out, "zhuge_sdk_sent_bytes_total", "counter",
+			"Upload request body bytes.", this->bytes_sent);
+		WritePrometheusMetric(out, "zhuge_sdk_spool_batches", "gauge",
+			"Batches in storage waiting for upload.", this->spool_batches);
+		WritePrometheusMetric(out, "zhuge_sdk_spool_bytes", "gauge",
+			"Bytes in storage waiting for upload.", this->spool_bytes);
+		WritePrometheusSummary(out, "zhuge_sdk_track_duration_seconds",
+			"Sampled Track call duration.", this->track_latency);
+		WritePrometheusSummary(out, "zhuge_sdk_serialize_duration_seconds",
+			"Time to serialize the task queue.", this->serialize_latency);
+		WritePrometheusSummary(out, "zhuge_sdk_upload_duration_seconds",
+			"Upload request round-trip time.", this->upload_latency);
+		WritePrometheusMetric(out, "zhuge_sdk_tls_handshakes_total", "counter",
+			"Completed TLS handshakes.", this->tls.handshakes);
+		WritePrometheusMetric(out, "zhuge_sdk_tls_resumed_handshakes_total", "counter",
+			"TLS handshakes completed by session resumption.", this->tls.resumed_handshakes);
+		WritePrometheusMetric(out, "zhuge_sdk_tls_handshake_seconds_total", "counter",
+			"Total time spent in TLS handshakes.", this->tls.handshake_microseconds / 1e6);
+		WritePrometheusMetric(out, "zhuge_sdk_event_pool_allocated_total", "counter",
+			"Event objects allocated by the event pool.", this->pool.allocated);
+		WritePrometheusMetric(out, "zhuge_sdk_event_pool_reused_total", "counter",
+			"Event objects reused from the event pool.", this->pool.reused);
+		WritePrometheusMetric(out, "zhuge_sdk_event_pool_recycled_total", "counter",
+			"Event objects returned to the event pool.", this->pool.recycled);
+		WritePrometheusMetric(out, "zhuge_sdk_event_pool_freed_total", "counter",
+			"Event objects freed because the event pool was full.", this->pool.freed);
+		WritePrometheusMetric(out, "zhuge_sdk_event_pool_pooled", "gauge",
+			"Free event objects in the event pool's global list.", this->pool.pooled);
+		return out.str();
+	}
+
+	// Prometheus指标接口
+	// 在独立线程中运行httplib::Server，通过GET /metrics输出当前的指标快照
+	class ZhugeSDKMetricsServer
+	{
+	private:
+		httplib::Server server;
+		std::thread server_thread;
+		std::atomic<bool> listen_returned;  // 监听线程已经退出
+	public:
+		ZhugeSDKMetricsServer(ZhugeSDK* sdk) :
+			listen_returned(false)
+		{
+			this->server.Get("/metrics", [sdk](const httplib::Request&, httplib::Response& res) {
+				res.set_content(sdk->GetStats().ToPrometheus(), "text/plain; version=0.0.4");
+			});
+
+			const ZhugeSDKConfig* config = sdk->sdk_config;
+			if (!this->server.bind_to_port(config->metrics_host.c_str(), config->metrics_port)) {
+				ZHUGE_LOG(sdk, ZHUGE_LOG_WARN, "Metrics server failed to bind "
+					<< config->metrics_host << ":" << config->metrics_port);
+				return;
+			}
+			this->server_thread = std::thread([this]{
+				this->server.listen_after_bind();
+				this->listen_returned.store(true);
+			});
+		}
+
+		~ZhugeSDKMetricsServer()
+		{
+			if (this->server_thread.joinable()) {
+				// 监听线程开始运行之前stop不会关闭监听端口，需要等待其开始运行，否则join会一直阻塞
+				while (!this->server.is_running() && !this->listen_returned.load()) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				this->server.stop();
+				this->server_thread.join();
+			}
+		}
+	};
+
 	SDKDataStorage::SDKDataStorage(ZhugeSDK* sdk) :
 		sdk(sdk)
 	{
@@ -123,13 +1008,15 @@ namespace zhugeio
 
 	void MemorySDKDataStorage::ResizeBuffer()
 	{
-		// 调整数据存储上限，只保留上限3/4的数据
-		if (buffer.size() >= this->sdk->sdk_config->max_storage_records) {
-			const int remove_num = this->sdk->sdk_config->max_storage_records * 4;
-			std::cout << "Resize buffer remove num: " << remove_num << std::endl;
-			for (int i = 0; i < remove_num; i++)
+		// 调整数据存储上限，丢弃最早的1/4，只保留上限3/4的数据
+		const size_t max_records = this->sdk->sdk_config->max_storage_records;
+		if (max_records > 0 && buffer.size() >= max_records) {
+			const size_t remove_num = buffer.size() - (max_records - max_records / 4);
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Storage is full, drop " << remove_num << " batches");
+			for (size_t i = 0; i < remove_num; i++)
 			{
 				buffer.pop_front();
+				this->sdk->GetMetrics().batches_dropped.Add(1);
 			}
 		}
 	}
@@ -151,8 +1038,66 @@ namespace zhugeio
 
 	}
 
+	bool MemorySDKDataStorage::Drained()
+	{
+		return this->buffer.empty();
+	}
+
+	void MemorySDKDataStorage::Spill()
+	{
+		if (this->buffer.empty()) {
+			return;
+		}
+		const std::string& spill_path = this->sdk->sdk_config->spill_file_path;
+		if (spill_path.empty()) {
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Shutdown with " << this->buffer.size() << " batches not uploaded");
+			this->sdk->GetMetrics().batches_dropped.Add(this->buffer.size());
+			this->buffer.clear();
+			return;
+		}
+
+		// 与文件存储的数据文件格式相同，将StorageFilePath指向该目录即可在下次启动时继续上传
+		using namespace std::chrono;
+		const long long ts = duration_cast<milliseconds>(
+			system_clock::now().time_since_epoch()).count();
+		std::ostringstream ss;
+		ss << spill_path << "zg" << ts;
+		const std::string filepath = ss.str();
+		std::ofstream output_file(filepath);
+		for (auto& batch : this->buffer) {
+			output_file << batch << '\n';
+		}
+		output_file.close();
+		if (output_file) {
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_INFO, "Spill " << this->buffer.size() << " batches to " << filepath);
+		}
+		else {
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Spill data to " << filepath << " error!");
+			this->sdk->GetMetrics().batches_dropped.Add(this->buffer.size());
+		}
+		this->buffer.clear();
+	}
+
+	// 数据目录中的索引文件，不以zg开头，不会被当作数据文件
+	static const std::string ZHUGE_STORAGE_MANIFEST = "manifest";
+	static const std::string ZHUGE_STORAGE_MANIFEST_HEADER = "zhuge-storage-manifest 1";
+
+	// 用新文件替换旧文件
+	static bool ZhugeReplaceFile(const std::string& from, const std::string& to)
+	{
+#ifdef _WIN32
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
 	FileSDKDataStorage::FileSDKDataStorage(ZhugeSDK* sdk) :
-		SDKDataStorage(sdk)
+		SDKDataStorage(sdk),
+		manifest_loaded(false),
+		manifest_dirty(false),
+		repair_pending(false),
+		loaded_segment(-1)
 	{
 
 	}
@@ -164,115 +1109,295 @@ namespace zhugeio
 
 	std::list<std::string>& FileSDKDataStorage::Load()
 	{
-		std::set<std::string> files;
-		this->GetFileList(files);  // 获取文件列表
-		if (files.empty()) {
-			if (this->sdk->sdk_config->enable_log) {
-				std::cout << "[ZhugeSDK] There is no data files to load!" << std::endl;
-			}
-		}
-		else {  // 有文件，从最新的文件中读取数据加入到buffer中
-			const std::string fname = *(files.rbegin());
-			if (this->sdk->sdk_config->enable_log) {
-				std::clog << "[ZhugeSDK] Load upload data from " << fname << std::endl;
-			}
-			this->last_read_file = fname;
-			std::ifstream input_file(
-				this->sdk->sdk_config->storage_file_path + fname);
-			if (input_file) {
-				std::string line;
-				while (std::getline(input_file, line)) {
-					if (!line.empty()) {
-						this->buffer.push_back(line);  // 写入缓冲
-					}
-				}
-				input_file.close();
-				if (this->sdk->sdk_config->enable_log) {
-					std::clog
-						<< "[ZhugeSDK] Load upload data from "
-						<< fname
-						<< " finished."
-						<< std::endl;
-				}
+		this->LoadManifest();
+		if (this->loaded_segment != -1) {
+			return this->buffer;  // 上次读取的数据尚未同步
+		}
+		if (this->segments.empty()) {
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "There is no data files to load!");
+			return this->buffer;
+		}
+
+		// 从最新的段中尚未上传的位置开始读取，数据加入到buffer中
+		const int index = static_cast<int>(this->segments.size()) - 1;
+		ZhugeStorageSegment& segment = this->segments[index];
+		ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "Load upload data from " << segment.name << ", offset: " << segment.offset);
+		std::ifstream input_file(
+			this->sdk->sdk_config->storage_file_path + segment.name, std::ios::in | std::ios::binary);
+		if (!input_file) {
+			struct stat file_stat;
+			if (stat((this->sdk->sdk_config->storage_file_path + segment.name).c_str(), &file_stat) != 0 && errno == ENOENT) {
+				ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Data file " << segment.name << " not found, remove it from the storage manifest");
+				this->segments.erase(this->segments.begin() + index);  // 文件已经不存在，从索引中删除
+				this->manifest_dirty = true;
 			}
-			else {
-				if (this->sdk->sdk_config->enable_log) {
-					std::clog
-						<< "[ZhugeSDK] Read file "
-						<< fname
-						<< " error!"
-						<< std::endl;
-				}
+			else {  // 暂时无法读取，保留在索引中，下个周期重试
+				ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Read file " << segment.name << " error!");
 			}
+			return this->buffer;
 		}
+
+		input_file.seekg(segment.offset);
+		long long position = segment.offset;
+		std::string line;
+		while (std::getline(input_file, line)) {
+			const long long line_begin = position;
+			position += line.size() + 1;
+			if (!line.empty() && line[line.size() - 1] == '\r') {  // 以文本模式写入的旧文件
+				line.erase(line.size() - 1);
+			}
+			if (!line.empty()) {
+				this->buffer.push_back(line);  // 写入缓冲
+				this->loaded_lines[&this->buffer.back()] = this->loaded_offsets.size();
+				this->loaded_offsets.push_back(line_begin);
+			}
+		}
+
+		// 索引落后于文件时（例如写入索引之前进程退出），以文件的实际大小为准
+		input_file.clear();
+		input_file.seekg(0, std::ios::end);
+		const long long file_size = input_file.tellg();
+		if (file_size >= 0 && position > file_size) {
+			position = file_size;
+		}
+		this->loaded_offsets.push_back(position);
+		if (segment.size != position) {
+			segment.size = position;
+			this->manifest_dirty = true;
+		}
+		this->loaded_segment = index;
+		ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "Load upload data from " << segment.name << " finished.");
 		return this->buffer;
 	}
 
 	void FileSDKDataStorage::Sync()
 	{
-		// 删除刚才加载的文件
-		if (!this->last_read_file.empty()) {
-			if (remove((
-				this->sdk->sdk_config->storage_file_path +
-				this->last_read_file).c_str())) {
-				if (this->sdk->sdk_config->enable_log) {
-					std::clog
-						<< "[ZhugeSDK] Error deleting file: "
-						<< this->last_read_file
-						<< std::endl;
-				}
+		this->LoadManifest();
+
+		// 区分剩余的数据来自读取的段还是新保存的数据，list中元素的地址在删除其它元素之后保持不变
+		std::vector<size_t> kept_lines;
+		std::vector<const std::string*> new_data;
+		for (auto& data : this->buffer) {
+			auto loaded = this->loaded_lines.find(&data);
+			if (loaded != this->loaded_lines.end()) {
+				kept_lines.push_back(loaded->second);
 			}
 			else {
-				if (this->sdk->sdk_config->enable_log) {
-					std::clog
-						<< "[ZhugeSDK] Data file: "
-						<< this->last_read_file
-						<< " deleted!"
-						<< std::endl;
-				}
+				new_data.push_back(&data);
 			}
 		}
+		if (this->loaded_segment != -1) {
+			this->SyncLoadedSegment(kept_lines);
+		}
+		this->AppendToSegments(new_data);
+		if (this->manifest_dirty) {
+			this->SaveManifest();
+		}
 
-		// 将buffer中剩余的数据写入到新的文件
-		if (!this->buffer.empty()) {
-			using namespace std::chrono;
-			const long long ts = duration_cast<milliseconds>(
-				system_clock::now().time_since_epoch()).count();
-			std::ostringstream ss;
-			ss << sdk->sdk_config->storage_file_path << "zg" << ts;
-			std::string filepath = ss.str();  // 基于时间戳，构建要写入的文件路径
-			std::ofstream output_file(filepath);
-			int count = 0;
-			for (auto itr = buffer.begin(); itr != buffer.end(); itr++) {
-				if (++count > sdk->sdk_config->max_storage_records) {  // 超过最大条数，写新文件
-					output_file.close();
-					std::this_thread::sleep_for(milliseconds(1));
-					const long long ts = duration_cast<milliseconds>(
-						system_clock::now().time_since_epoch()).count();
-					std::ostringstream ss;
-					ss << sdk->sdk_config->storage_file_path << "zg" << ts;
-					std::string filepath = ss.str();  // 基于时间戳，构建要写入的文件路径
-					output_file = std::ofstream(filepath);
-					count = 0;
-					if (this->sdk->sdk_config->enable_log) {
-						std::clog
-							<< "[ZhugeSDK] New data file "
-							<< filepath
-							<< " created."
-							<< std::endl;
-					}
+		// 清空buffer所有数据
+		this->buffer.clear();
+		this->loaded_lines.clear();
+		this->loaded_offsets.clear();
+		this->loaded_segment = -1;
+	}
+
+	void FileSDKDataStorage::Spill()
+	{
+		this->Sync();  // 写入尚未上传的新数据
+	}
+
+	bool FileSDKDataStorage::Drained()
+	{
+		// 每个上传周期只读取最新的一个段，除了本周期读取的段，其它的段仍在等待上传
+		const size_t loaded = this->loaded_segment != -1 ? 1 : 0;
+		return this->buffer.empty() && this->segments.size() <= loaded;
+	}
+
+	void FileSDKDataStorage::SyncLoadedSegment(const std::vector<size_t>& kept_lines)
+	{
+		ZhugeStorageSegment& segment = this->segments[this->loaded_segment];
+		const std::string filepath = this->sdk->sdk_config->storage_file_path + segment.name;
+		const size_t loaded = this->loaded_offsets.size() - 1;
+
+		if (kept_lines.empty()) {  // 段中的数据都已经上传，删除文件
+			if (remove(filepath.c_str())) {
+				ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Error deleting file: " << segment.name);
+			}
+			else {
+				ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "Data file: " << segment.name << " deleted!");
+			}
+			this->segments.erase(this->segments.begin() + this->loaded_segment);
+			this->manifest_dirty = true;
+		}
+		else if (kept_lines.back() == loaded - 1 && kept_lines.back() - kept_lines.front() + 1 == kept_lines.size()) {
+			// 剩余的数据在段的末尾，只需推进上传位置
+			const long long offset = this->loaded_offsets[kept_lines.front()];
+			if (segment.offset != offset) {
+				segment.offset = offset;
+				this->manifest_dirty = true;
+			}
+		}
+		else {
+			// 上传成功的数据不连续，重写段中剩余的数据
+			const std::string temp_path = filepath + ".tmp";
+			std::ofstream output_file(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+			long long size = 0;
+			for (auto& data : this->buffer) {
+				if (this->loaded_lines.count(&data)) {
+					output_file << data << '\n';
+					size += data.size() + 1;
 				}
-				output_file << (*itr) << std::endl;
 			}
 			output_file.close();
+			if (output_file && ZhugeReplaceFile(temp_path, filepath)) {
+				segment.offset = 0;
+				segment.size = size;
+				this->manifest_dirty = true;
+			}
+			else {
+				ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Rewrite data file " << segment.name << " error!");
+			}
 		}
+	}
 
-		// 清空buffer所有数据
-		this->buffer.clear();
-		this->last_read_file = "";
+	void FileSDKDataStorage::AppendToSegments(const std::vector<const std::string*>& data)
+	{
+		if (data.empty()) {
+			return;
+		}
+
+		// 追加到最新的段，段中的批次数达到上限时创建新的段
+		const size_t max_lines = std::max<size_t>(1, this->sdk->sdk_config->max_storage_records);
+		std::ofstream output_file;
+		for (auto item : data) {
+			if (!output_file.is_open() || this->segments.back().lines >= max_lines) {
+				output_file.close();
+				if (this->segments.empty() || this->segments.back().lines >= max_lines) {
+					ZhugeStorageSegment segment = { this->NewSegmentName(), 0, 0, 0 };
+					this->segments.push_back(segment);
+					// 先将新的段写入索引再创建文件，进程在写入数据之后退出时，段仍然在索引中，读取时以文件的实际内容为准
+					this->SaveManifest();
+					ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "New data file " << segment.name << " created.");
+				}
+				output_file.open(
+					this->sdk->sdk_config->storage_file_path + this->segments.back().name,
+					std::ios::out | std::ios::binary | std::ios::app);
+			}
+			output_file << *item << '\n';
+			this->segments.back().size += item->size() + 1;
+			this->segments.back().lines++;
+		}
+		output_file.close();
+		this->manifest_dirty = true;
+	}
+
+	std::string FileSDKDataStorage::NewSegmentName()
+	{
+		// 基于时间戳构建文件名，保证晚于已有的段
+		using namespace std::chrono;
+		long long ts = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+		if (!this->segments.empty()) {
+			const long long last = atoll(this->segments.back().name.c_str() + 2);
+			if (ts <= last) {
+				ts = last + 1;
+			}
+		}
+		return "zg" + std::to_string(ts);
+	}
+
+	void FileSDKDataStorage::LoadManifest()
+	{
+		if (this->manifest_loaded) {
+			if (this->repair_pending && this->loaded_segment == -1) {  // 加入文件会改变段的顺序，不在读取段之后重试
+				this->repair_pending = !this->AdoptDataFiles();
+			}
+			return;
+		}
+		this->manifest_loaded = true;
+
+		const std::string& data_path = this->sdk->sdk_config->storage_file_path;
+		std::ifstream input_file(data_path + ZHUGE_STORAGE_MANIFEST);
+		std::string header;
+		if (input_file && std::getline(input_file, header) &&
+			header.compare(0, ZHUGE_STORAGE_MANIFEST_HEADER.size(), ZHUGE_STORAGE_MANIFEST_HEADER) == 0) {
+			ZhugeStorageSegment segment;
+			while (input_file >> segment.name >> segment.offset >> segment.size >> segment.lines) {
+				this->segments.push_back(segment);
+			}
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_DEBUG, "Load storage manifest, data files: " << this->segments.size());
+			if (!this->sdk->sdk_config->repair_storage) {
+				return;  // 信任索引，段文件在读取时才检查是否存在
+			}
+		}
+		else {
+			this->manifest_dirty = true;  // 第一次启动、由没有索引的旧版本升级，或者数据目录为溢出文件的目录
+		}
+		this->repair_pending = !this->AdoptDataFiles();
 	}
 
-	void FileSDKDataStorage::GetFileList(std::set<std::string> &files)
+	bool FileSDKDataStorage::AdoptDataFiles()
+	{
+		// 扫描数据目录，将索引中没有的数据文件作为新的段加入，例如将SpillFilePath中的文件放入已有索引的数据目录；
+		// 不会因为扫描结果删除索引中的段，扫描失败时返回false，保留原有的索引
+		const std::string& data_path = this->sdk->sdk_config->storage_file_path;
+		std::set<std::string> files;
+		if (!this->GetFileList(files)) {
+			return false;
+		}
+		std::set<std::string> listed;
+		for (auto& segment : this->segments) {
+			listed.insert(segment.name);
+		}
+		bool adopted = false;
+		for (auto& name : files) {
+			if (name.find('.') != std::string::npos || listed.count(name)) {  // 未完成的临时文件或已有的段
+				continue;
+			}
+			std::ifstream data_file(data_path + name, std::ios::in | std::ios::binary | std::ios::ate);
+			const long long size = data_file.tellg();
+			if (size > 0) {
+				// 作为已写满的段加入，不再向其中追加数据
+				ZhugeStorageSegment segment = { name, 0, size, this->sdk->sdk_config->max_storage_records };
+				this->segments.push_back(segment);
+				adopted = true;
+			}
+		}
+		if (adopted) {
+			// 段按创建时间排序，文件名为zg加上创建时的毫秒时间戳
+			std::stable_sort(this->segments.begin(), this->segments.end(),
+				[](const ZhugeStorageSegment& a, const ZhugeStorageSegment& b) {
+					return atoll(a.name.c_str() + 2) < atoll(b.name.c_str() + 2);
+				});
+			this->manifest_dirty = true;
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_INFO, "Adopt data files not in the storage manifest, data files: " << this->segments.size());
+		}
+		return true;
+	}
+
+	void FileSDKDataStorage::SaveManifest()
+	{
+		// 先写入临时文件再替换，进程在写入过程中退出时不会损坏原有的索引
+		long long pending_bytes = 0;
+		for (auto& segment : this->segments) {
+			pending_bytes += segment.size - segment.offset;
+		}
+		const std::string manifest_path = this->sdk->sdk_config->storage_file_path + ZHUGE_STORAGE_MANIFEST;
+		const std::string temp_path = manifest_path + ".tmp";
+		std::ofstream output_file(temp_path, std::ios::out | std::ios::trunc);
+		output_file << ZHUGE_STORAGE_MANIFEST_HEADER << " " << this->segments.size() << " " << pending_bytes << "\n";
+		for (auto& segment : this->segments) {
+			output_file << segment.name << " " << segment.offset << " " << segment.size << " " << segment.lines << "\n";
+		}
+		output_file.close();
+		if (output_file && ZhugeReplaceFile(temp_path, manifest_path)) {
+			this->manifest_dirty = false;
+		}
+		else {
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Write storage manifest error!");
+		}
+	}
+
+	bool FileSDKDataStorage::GetFileList(std::set<std::string> &files)
 	{
 		std::string data_path = this->sdk->sdk_config->storage_file_path;
 #ifdef _WIN32
@@ -281,13 +1406,8 @@ namespace zhugeio
 		std::string find_path(data_path + "*");
 		HANDLE = _findfirst(find_path.c_str(), &file);
 		if (HANDLE == -1L) {  // Find file failure
-			if (this->sdk->sdk_config->enable_log) {
-				std::clog 
-					<< "Find file failure under the path: " 
-					<< data_path 
-					<< std::endl;
-			}
-			return;
+			ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Find file failure under the path: " << data_path);
+			return false;
 		}
 		do {
 			const std::string filename(file.name);
@@ -295,6 +1415,8 @@ namespace zhugeio
 				files.insert(filename);
 			}
 		} while (_findnext(HANDLE, &file) == 0);
+		_findclose(HANDLE);
+		return true;
 #else
 		DIR *dir;
 		struct dirent *diread;
@@ -305,25 +1427,405 @@ namespace zhugeio
 					files.insert(filename);
 				}
 			}
-			closedir(dir);
+			closedir(dir);
+			return true;
+		}
+		// 读取失败
+		ZHUGE_LOG(this->sdk, ZHUGE_LOG_WARN, "Open data path " << data_path << " error!");
+		return false;
+#endif
+	}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+	typedef httplib::SSLClient ZhugeHTTPClient;
+#else
+	typedef httplib::Client ZhugeHTTPClient;
+#endif
+
+	// 上传节点连接
+	struct ZhugeSDKConnection
+	{
+		ZhugeSDKConnectionPool* pool;
+		std::unique_ptr<ZhugeHTTPClient> client;
+		socket_t socket;  // 客户端最近创建的套接字，由套接字选项回调记录
+		bool requesting;  // 正在执行请求，关闭时可以直接关闭其套接字
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+		SSL_SESSION* session;  // 最近一次握手得到的TLS会话，用于下次建立连接时复用
+		std::chrono::steady_clock::time_point handshake_begin;
+#endif
+	};
+
+	// 上传API连接池
+	// 每个上传节点保持一个客户端，跨上传周期复用；启用SSL时同时复用SSL上下文与TLS会话，
+	// 每个上传周期结束时关闭连接，下个周期重新连接时通过会话复用完成简化握手
+	class ZhugeSDKConnectionPool
+	{
+	private:
+		const ZhugeSDKConfig* config;
+		std::vector<std::unique_ptr<ZhugeSDKConnection>> connections;
+		std::atomic<unsigned long long> handshakes;
+		std::atomic<unsigned long long> resumed_handshakes;
+		std::atomic<unsigned long long> handshake_microseconds;
+		std::mutex mutex;  // 保护客户端的创建与关闭
+		std::mutex socket_mutex;  // 保护套接字记录，持有时不调用httplib，中断时不会等待进行中的连接与握手
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+		static void TLSInfoCallback(const SSL* ssl, int where, int ret);
+		static int TLSNewSessionCallback(SSL* ssl, SSL_SESSION* session);
+#endif
+	public:
+		ZhugeSDKConnectionPool(const ZhugeSDKConfig* config) :
+			config(config)
+		{
+			this->handshakes.store(0);
+			this->resumed_handshakes.store(0);
+			this->handshake_microseconds.store(0);
+			for (size_t i = 0; i < config->api_endpoints.size(); i++) {
+				ZhugeSDKConnection* connection = new ZhugeSDKConnection();
+				connection->pool = this;
+				connection->socket = INVALID_SOCKET;
+				connection->requesting = false;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+				connection->session = nullptr;
+#endif
+				this->connections.emplace_back(connection);
+			}
+		}
+
+		// 获取指定节点的客户端，第一次使用时创建
+		ZhugeHTTPClient& GetClient(int index)
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			ZhugeSDKConnection& connection = *(this->connections[index]);
+			if (!connection.client) {
+				const ZhugeSDKEndpoint& endpoint = this->config->api_endpoints[index];
+				ZhugeHTTPClient* cli = new ZhugeHTTPClient(endpoint.host.c_str(), endpoint.port);
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+				cli->enable_server_certificate_verification(false);
+
+				// 由SDK在客户端一侧保存会话，并在握手开始时设置到连接上
+				SSL_CTX* ctx = cli->ssl_context();
+				if (ctx != nullptr) {
+					SSL_CTX_set_app_data(ctx, &connection);
+					SSL_CTX_set_session_cache_mode(
+						ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+					SSL_CTX_sess_set_new_cb(ctx, TLSNewSessionCallback);
+					SSL_CTX_set_info_callback(ctx, TLSInfoCallback);
+				}
+#endif
+
+				// 设置API调用超时选项
+				cli->set_connection_timeout(this->config->api_connection_timeout, 0);
+				cli->set_read_timeout(this->config->api_read_timeout, 0);
+				cli->set_write_timeout(this->config->api_write_timeout, 0);
+
+				// 同一个上传周期内的多个请求复用连接，关闭Nagle算法避免连续请求等待延迟确认
+				cli->set_keep_alive(true);
+				cli->set_tcp_nodelay(true);
+
+				// 记录连接使用的套接字，连接与TLS握手期间httplib持有自己的锁，中断时直接关闭套接字
+				ZhugeSDKConnection* connection_ptr = &connection;
+				cli->set_socket_options([connection_ptr](socket_t sock) {
+					httplib::default_socket_options(sock);
+					std::lock_guard<std::mutex> socket_lock(connection_ptr->pool->socket_mutex);
+					connection_ptr->socket = sock;
+				});
+				connection.client.reset(cli);
+			}
+			return *(connection.client);
+		}
+
+		// 开始一次请求，连接已经关闭时不再记录其套接字
+		void BeginRequest(int index)
+		{
+			ZhugeSDKConnection& connection = *(this->connections[index]);
+			const bool socket_open = connection.client->is_socket_open() != 0;
+			std::lock_guard<std::mutex> socket_lock(this->socket_mutex);
+			if (!socket_open) {
+				connection.socket = INVALID_SOCKET;
+			}
+			connection.requesting = true;
+		}
+
+		// 请求结束，失败时httplib已经关闭了连接
+		void EndRequest(int index, bool success)
+		{
+			ZhugeSDKConnection& connection = *(this->connections[index]);
+			std::lock_guard<std::mutex> socket_lock(this->socket_mutex);
+			connection.requesting = false;
+			if (!success) {
+				connection.socket = INVALID_SOCKET;
+			}
+		}
+
+		// 中断进行中的请求：关闭其套接字，进行中的连接、握手与读写立即失败。
+		// 可以在其它线程中调用，不等待httplib的锁
+		void Interrupt()
+		{
+			std::lock_guard<std::mutex> socket_lock(this->socket_mutex);
+			for (auto& connection : this->connections) {
+				if (connection->requesting && connection->socket != INVALID_SOCKET) {
+					httplib::detail::shutdown_socket(connection->socket);
+				}
+			}
+		}
+
+		// 关闭所有连接，保留客户端及其SSL上下文、TLS会话；只在上传周期中调用
+		void CloseAll()
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			for (auto& connection : this->connections) {
+				if (connection->client) {
+					connection->client->stop();
+				}
+			}
+			std::lock_guard<std::mutex> socket_lock(this->socket_mutex);
+			for (auto& connection : this->connections) {
+				connection->socket = INVALID_SOCKET;
+			}
+		}
+
+		ZhugeSDKTLSStats GetTLSStats()
+		{
+			ZhugeSDKTLSStats stats;
+			stats.handshakes = this->handshakes.load();
+			stats.resumed_handshakes = this->resumed_handshakes.load();
+			stats.handshake_microseconds = this->handshake_microseconds.load();
+			return stats;
+		}
+
+		~ZhugeSDKConnectionPool()
+		{
+			for (auto& connection : this->connections) {
+				connection->client.reset();
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+				if (connection->session != nullptr) {
+					SSL_SESSION_free(connection->session);
+				}
+#endif
+			}
+		}
+	};
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+	void ZhugeSDKConnectionPool::TLSInfoCallback(const SSL* ssl, int where, int /* ret */)
+	{
+		ZhugeSDKConnection* connection = static_cast<ZhugeSDKConnection*>(
+			SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+		if (connection == nullptr) {
+			return;
+		}
+
+		using namespace std::chrono;
+		if (where & SSL_CB_HANDSHAKE_START) {
+			connection->handshake_begin = steady_clock::now();
+			// ClientHello尚未构建，此时设置会话即可请求服务端复用
+			if (SSL_in_before(ssl) && connection->session != nullptr) {
+				SSL_set_session(const_cast<SSL*>(ssl), connection->session);
+			}
+		}
+		else if (where & SSL_CB_HANDSHAKE_DONE) {
+			ZhugeSDKConnectionPool* pool = connection->pool;
+			pool->handshakes++;
+			if (SSL_session_reused(const_cast<SSL*>(ssl))) {
+				pool->resumed_handshakes++;
+			}
+			pool->handshake_microseconds += duration_cast<microseconds>(
+				steady_clock::now() - connection->handshake_begin).count();
+		}
+	}
+
+	int ZhugeSDKConnectionPool::TLSNewSessionCallback(SSL* ssl, SSL_SESSION* session)
+	{
+		ZhugeSDKConnection* connection = static_cast<ZhugeSDKConnection*>(
+			SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+		if (connection == nullptr) {
+			return 0;
+		}
+		if (connection->session != nullptr) {
+			SSL_SESSION_free(connection->session);
+		}
+		connection->session = session;
+		return 1;  // 接管会话的引用
+	}
+#endif
+
+	ZhugeSDKEndpointSelector::ZhugeSDKEndpointSelector(
+		const std::vector<ZhugeSDKEndpoint>& endpoints, long long failure_latency_ms) :
+		failure_latency_ms(failure_latency_ms)
+	{
+		for (auto& endpoint : endpoints) {
+			ZhugeSDKEndpointState state = { endpoint, 0.0, 0.0, 0, 0 };
+			this->states.push_back(state);
+		}
+	}
+
+	double ZhugeSDKEndpointSelector::Score(const ZhugeSDKEndpointState& state)
+	{
+		// 分值越低越优：延迟越高、错误率越高，分值越高
+		const double error_factor = 1.0 - state.error_rate < 0.05 ? 0.05 : 1.0 - state.error_rate;
+		return (state.ewma_latency_ms + 1.0) / error_factor;
+	}
+
+	int ZhugeSDKEndpointSelector::Acquire(const std::set<int>& excluded)
+	{
+		using namespace std::chrono;
+		const long long now = duration_cast<milliseconds>(
+			steady_clock::now().time_since_epoch()).count();
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		int best = -1;
+		int fallback = -1;  // 所有节点都处于熔断状态时，选择最早结束冷却的节点
+		for (int i = 0; i < (int)this->states.size(); i++) {
+			if (excluded.count(i)) {
+				continue;
+			}
+			const ZhugeSDKEndpointState& state = this->states[i];
+			if (state.retry_after > now) {
+				if (fallback == -1 || state.retry_after < this->states[fallback].retry_after) {
+					fallback = i;
+				}
+				continue;
+			}
+			if (best == -1 || Score(state) < Score(this->states[best])) {
+				best = i;
+			}
+		}
+		if (best == -1) {
+			best = fallback;
+		}
+		return best;
+	}
+
+	void ZhugeSDKEndpointSelector::Release(int index, bool success, long long latency_ms)
+	{
+		using namespace std::chrono;
+		std::lock_guard<std::mutex> lock(this->mutex);
+		ZhugeSDKEndpointState& state = this->states[index];
+		const double alpha = DEFAULT_ENDPOINT_EWMA_ALPHA;
+		state.error_rate = alpha * (success ? 0.0 : 1.0) + (1 - alpha) * state.error_rate;
+
+		// 失败的请求至少按连接超时计入延迟，否则从未成功的节点延迟为0，冷却结束后会再次被优先选择
+		const double sample_ms = success ? (double)latency_ms : (double)std::max(latency_ms, this->failure_latency_ms);
+		state.ewma_latency_ms = state.ewma_latency_ms == 0.0 ?
+			sample_ms : alpha * sample_ms + (1 - alpha) * state.ewma_latency_ms;
+		if (success) {
+			state.consecutive_failures = 0;
+			state.retry_after = 0;
+		}
+		else if (++state.consecutive_failures >= DEFAULT_ENDPOINT_MAX_FAILURES) {
+			// 连续失败，暂时摘除该节点
+			state.retry_after = duration_cast<milliseconds>(
+				steady_clock::now().time_since_epoch()).count() + DEFAULT_ENDPOINT_COOLDOWN_MILLISECONDS;
+		}
+	}
+
+	ZhugeSDKRateLimiter::ZhugeSDKRateLimiter(
+		size_t bytes_per_second, size_t burst_bytes, double requests_per_second) :
+		bytes_per_second((double)bytes_per_second),
+		burst_bytes(burst_bytes > 0 ? (double)burst_bytes : (double)bytes_per_second),
+		requests_per_second(requests_per_second),
+		burst_requests(requests_per_second > 1 ? requests_per_second : 1),
+		last_refill(std::chrono::steady_clock::now()),
+		cancelled(false)
+	{
+		this->byte_tokens = this->burst_bytes;
+		this->request_tokens = this->burst_requests;
+	}
+
+	void ZhugeSDKRateLimiter::Acquire(size_t bytes)
+	{
+		if (this->bytes_per_second <= 0 && this->requests_per_second <= 0) {
+			return;  // 不限速
+		}
+
+		using namespace std::chrono;
+		double wait_seconds = 0;
+		std::unique_lock<std::mutex> lock(this->mutex);
+		const steady_clock::time_point now = steady_clock::now();
+		const double elapsed = duration_cast<duration<double>>(now - this->last_refill).count();
+		this->last_refill = now;
+
+		// 先补充令牌，再预扣本次请求所需的令牌，令牌不足时欠账，由调用者等待欠账还清
+		if (this->bytes_per_second > 0) {
+			this->byte_tokens = std::min(
+				this->burst_bytes, this->byte_tokens + elapsed * this->bytes_per_second);
+			this->byte_tokens -= bytes;
+			if (this->byte_tokens < 0) {
+				wait_seconds = -this->byte_tokens / this->bytes_per_second;
+			}
 		}
-		else {  // 读取失败
-			if (this->sdk->sdk_config->enable_log) {
-				std::clog
-					<< "Open data path "
-					<< data_path
-					<< " error!"
-					<< std::endl;
+		if (this->requests_per_second > 0) {
+			this->request_tokens = std::min(
+				this->burst_requests, this->request_tokens + elapsed * this->requests_per_second);
+			this->request_tokens -= 1;
+			if (this->request_tokens < 0) {
+				wait_seconds = std::max(wait_seconds, -this->request_tokens / this->requests_per_second);
 			}
 		}
-#endif
+
+		if (wait_seconds > 0) {  // 等待欠账还清，等待时释放锁，关闭时被Cancel唤醒
+			this->cond.wait_for(lock, duration_cast<nanoseconds>(duration<double>(wait_seconds)),
+				[this]{ return this->cancelled; });
+		}
 	}
 
+	void ZhugeSDKRateLimiter::Cancel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->cancelled = true;
+		}
+		this->cond.notify_all();
+	}
+
+	// 上传周期任务持有的句柄，上传任务对象释放之后process为空，执行器中尚未执行的任务不再访问它
+	struct ZhugeSDKProcessHandle
+	{
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool running;  // 正在执行上传周期，同一时间只执行一个上传周期
+		bool rerun;  // 执行期间收到了立即唤醒，周期结束后重新提交
+		int rescheduling;  // 正在不持有锁地向执行器提交下一个周期的任务数
+		bool abandoned;  // Stop到时未等到周期结束就已经返回，由该周期结束时写入磁盘
+		ZhugeSDKTaskProcess* process;
+
+		// 没有进行中的上传周期，也没有正在提交的任务，上传任务对象可以被释放
+		bool Idle() const
+		{
+			return !this->running && this->rescheduling == 0;
+		}
+	};
+
 	ZhugeSDKTaskProcess::ZhugeSDKTaskProcess(ZhugeSDK* sdk) :
 		zhuge_sdk(sdk),
-		upload_data_queue()
+		upload_data_queue(),
+		endpoint_selector(sdk->sdk_config->api_endpoints, sdk->sdk_config->api_connection_timeout * 1000LL),
+		connection_pool(new ZhugeSDKConnectionPool(sdk->sdk_config)),
+		rate_limiter(
+			sdk->sdk_config->max_upload_bytes_per_second,
+			sdk->sdk_config->upload_burst_bytes,
+			sdk->sdk_config->max_upload_requests_per_second)
 	{
 		this->stop_mark.store(false);
+		this->state.store(ZHUGE_PROCESS_IDLE);
+		this->upload_deadline.store(0);
+		this->executor = sdk->sdk_config->executor;
+		if (!this->executor) {
+			this->executor = std::make_shared<ZhugeSDKWorkerPool>(1);
+		}
+		this->handle = std::make_shared<ZhugeSDKProcessHandle>();
+		this->handle->running = false;
+		this->handle->rerun = false;
+		this->handle->rescheduling = 0;
+		this->handle->abandoned = false;
+		this->handle->process = this;
+		this->cycle_generation = 0;
+#ifndef CPPHTTPLIB_ZLIB_SUPPORT
+		if (sdk->sdk_config->upload_body_mode == ZHUGE_UPLOAD_BODY_GZIP) {
+			ZHUGE_LOG(sdk, ZHUGE_LOG_WARN, "UploadBodyMode gzip requires CPPHTTPLIB_ZLIB_SUPPORT and zlib, upload as JSON");
+		}
+#endif
+		this->wake_pending.store(false);
 		if (sdk->sdk_config->storage_file_path.empty()) {
 			this->data_storage = new MemorySDKDataStorage(sdk);
 		}
@@ -332,9 +1834,9 @@ namespace zhugeio
 		}
 	}
 
-	void ZhugeSDKTaskProcess::BuildFullUploadData(Json::Value& root)
+	void ZhugeSDKTaskProcess::BuildFullUploadData(ZhugeSDK* owner, Json::Value& root)
 	{
-		root["ak"] = zhuge_sdk->sdk_config->app_key;
+		root["ak"] = owner->GetAppKey();
 		root["debug"] = zhuge_sdk->sdk_config->enable_debug ? 1 : 0;
 		root["sln"] = "itn";
 		root["owner"] = "zg";
@@ -342,173 +1844,714 @@ namespace zhugeio
 		root["sdk"] = "zg";
 		root["sdkv"] = "2.0";
 		root["tz"] = zhuge_sdk->sdk_config->time_zone;
-		root["usr"]["did"] = zhuge_sdk->GetDeviceID();
+		root["usr"]["did"] = owner->GetDeviceID();
 		time_t t = time(0);
+		struct tm local_time;  // 多个实例可能在共享执行器上并发组包，不能使用localtime的静态结果
+#ifdef _WIN32
+		localtime_s(&local_time, &t);
+#else
+		localtime_r(&t, &local_time);
+#endif
 		char t_buf[255];
-		strftime(t_buf, sizeof(t_buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		strftime(t_buf, sizeof(t_buf), "%Y-%m-%d %H:%M:%S", &local_time);
 		root["ut"] = t_buf;
 	}
 
-	void ZhugeSDKTaskProcess::TransDataWithAPI()
+	// 两个批次的信封是否相同，即除了data与上传时间ut之外的成员完全相同
+	// 只通过常量引用读取成员，不会向批次中插入空成员
+	static bool ZhugeSameEnvelope(const Json::Value& a, const Json::Value& b)
+	{
+		for (auto& member : a.getMemberNames()) {
+			if (member != "data" && member != "ut" && (!b.isMember(member) || a[member] != b[member])) {
+				return false;
+			}
+		}
+		for (auto& member : b.getMemberNames()) {  // b中多出的成员
+			if (member != "data" && member != "ut" && !a.isMember(member)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t ZhugeSDKTaskProcess::BuildUploadFrame(
+		std::list<std::string>& all_data, std::list<std::string>::iterator begin, std::string& frame)
+	{
+		const size_t max_frame_bytes = this->zhuge_sdk->sdk_config->max_frame_bytes;
+
+		// 计算在字节上限内可以合并的批次数目，至少包含一个批次
+		size_t count = 1;
+		size_t frame_bytes = begin->size();
+		for (auto itr = std::next(begin); itr != all_data.end(); itr++) {
+			if (frame_bytes + itr->size() > max_frame_bytes) {
+				break;
+			}
+			frame_bytes += itr->size();
+			count++;
+		}
+		if (count == 1) {
+			return 1;
+		}
+
+		// 以第一个批次为信封，将后续批次的事件追加到data中
+		Json::Reader json_reader;
+		Json::Value root;
+		if (!json_reader.parse(*begin, root, false) || !root.isObject() || !root.get("data", Json::Value()).isArray()) {
+			return 1;
+		}
+		Json::Value& root_data = root["data"];
+		size_t merged = 1;
+		for (auto itr = std::next(begin); merged < count; itr++, merged++) {
+			Json::Value batch;
+			if (!json_reader.parse(*itr, batch, false) || !batch.isObject()) {
+				break;
+			}
+			const Json::Value& batch_ref = batch;
+			const Json::Value& batch_data = batch_ref["data"];
+			// 只有信封相同（仅上传时间不同）的批次才能合并
+			if (!batch_data.isArray() || !ZhugeSameEnvelope(root, batch)) {
+				break;
+			}
+
+			for (auto& element : batch_data) {
+				root_data.append(element);
+			}
+		}
+		if (merged == 1) {
+			return 1;
+		}
+
+		Json::FastWriter json_writer;
+		frame = json_writer.write(root);
+		return merged;
+	}
+
+	bool ZhugeSDKTaskProcess::TransDataWithAPI()
 	{
 		try {
 			std::list<std::string>& all_data = this->data_storage->Load();
+			ZhugeSDKMetrics& metrics = this->zhuge_sdk->GetMetrics();
+			this->UpdateSpoolMetrics(all_data);
 			if (all_data.empty()) {
-				return;
+				return this->data_storage->Drained();
 			}
 
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-			httplib::SSLClient cli(
-				this->zhuge_sdk->sdk_config->api_host.c_str(), this->zhuge_sdk->sdk_config->api_port);
-			cli.enable_server_certificate_verification(false);
-#else
-			httplib::Client cli(
-				this->zhuge_sdk->sdk_config->api_host.c_str(), this->zhuge_sdk->sdk_config->api_port);
-#endif
-
-			// 设置API调用超时选项
-			cli.set_connection_timeout(this->zhuge_sdk->sdk_config->api_connection_timeout, 0);
-			cli.set_read_timeout(this->zhuge_sdk->sdk_config->api_read_timeout, 0);
-			cli.set_write_timeout(this->zhuge_sdk->sdk_config->api_write_timeout, 0);
-
-			// 执行上传
+			// 执行上传，Content-Type由httplib根据请求体格式进行设置
 			httplib::Headers headers = {
-				{ "User-Agent", "ZHUGE-CPP-SDK" },
-				{ "Content-Type", "x-www-form-urlencode;charset=utf-8" }
+				{ "User-Agent", "ZHUGE-CPP-SDK" }
 			};
+			const bool raw_body = this->zhuge_sdk->sdk_config->upload_body_mode != ZHUGE_UPLOAD_BODY_FORM;
+			const char* content_type = raw_body ?
+				"application/json;charset=utf-8" : "application/x-www-form-urlencoded";
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+			const bool gzip_body = this->zhuge_sdk->sdk_config->upload_body_mode == ZHUGE_UPLOAD_BODY_GZIP;
+			httplib::Headers gzip_headers = headers;  // 只有压缩成功的请求体才声明gzip编码
+			gzip_headers.emplace("Content-Encoding", "gzip");
+#endif
 
 			for (auto itr = all_data.begin(); itr != all_data.end();) {
-				std::string data = *itr;
-				httplib::Params params;
-				params.emplace("event", data);
+				if (this->UploadBudgetMilliseconds() == 0) {
+					break;  // 关闭时的上传时间已经用完，剩余的数据写入磁盘
+				}
 
-				if (this->zhuge_sdk->sdk_config->enable_log) {
-					std::clog << "[ZhugeSDK] Upload data: " << data << std::endl;
+				// 将多个已保存的批次合并为一个请求帧，帧中的批次在上传成功后一并删除
+				std::string frame;
+				const size_t frame_batches = this->BuildUploadFrame(all_data, itr, frame);
+				const std::string& data = frame_batches > 1 ? frame : *itr;
+
+				// 表单格式的URL编码与gzip格式的压缩在此完成，以便按实际的请求体大小进行限速
+				std::string encoded_body;
+				bool encoded = false;
+				const httplib::Headers* request_headers = &headers;
+				if (!raw_body) {
+					encoded_body = "event=" + httplib::detail::encode_url(data);
+					encoded = true;
+				}
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+				else if (gzip_body) {
+					httplib::detail::gzip_compressor compressor;
+					encoded = compressor.compress(data.data(), data.size(), true,
+						[&encoded_body](const char* chunk, size_t length) {
+							encoded_body.append(chunk, length);
+							return true;
+						});
+					if (encoded) {
+						request_headers = &gzip_headers;
+					}
+					else {  // 压缩失败时以未压缩的JSON上传，不声明gzip编码
+						ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_WARN, "Gzip upload data error, upload as JSON");
+					}
 				}
+#endif
+				const std::string& body = encoded ? encoded_body : data;
+
+				ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_DEBUG, "Upload data: " << data);
+
+				// 按节点优劣依次尝试，失败则切换到下一个节点
+				bool uploaded = false;
+				int status = 0;
+				std::string endpoint_name;
+				std::set<int> tried;
+				int index;
+				while (!uploaded && this->UploadBudgetMilliseconds() != 0 &&
+					(index = this->endpoint_selector.Acquire(tried)) != -1) {
+					tried.insert(index);
+					const ZhugeSDKEndpoint& endpoint = this->endpoint_selector.GetEndpoint(index);
+					ZhugeHTTPClient& cli = this->connection_pool->GetClient(index);
+
+					// 上传限速，关闭时被取消
+					if (this->UploadBudgetMilliseconds() < 0) {
+						this->rate_limiter.Acquire(body.size());
+					}
+
+					// 每次请求之前重新设置超时：关闭中不超过剩余的上传时间，限速等待期间也可能开始关闭
+					const long long budget = this->UploadBudgetMilliseconds();
+					if (budget == 0) {
+						break;
+					}
+					const ZhugeSDKConfig* config = this->zhuge_sdk->sdk_config;
+					const long long connection_ms = budget > 0 ?
+						std::min<long long>(config->api_connection_timeout * 1000LL, budget) : config->api_connection_timeout * 1000LL;
+					const long long read_ms = budget > 0 ?
+						std::min<long long>(config->api_read_timeout * 1000LL, budget) : config->api_read_timeout * 1000LL;
+					const long long write_ms = budget > 0 ?
+						std::min<long long>(config->api_write_timeout * 1000LL, budget) : config->api_write_timeout * 1000LL;
+					cli.set_connection_timeout(connection_ms / 1000, (connection_ms % 1000) * 1000);
+					cli.set_read_timeout(read_ms / 1000, (read_ms % 1000) * 1000);
+					cli.set_write_timeout(write_ms / 1000, (write_ms % 1000) * 1000);
+
+					using namespace std::chrono;
+					const steady_clock::time_point begin = steady_clock::now();
+					this->connection_pool->BeginRequest(index);  // 关闭超时时由Stop中断
+					auto res = cli.Post(
+						this->zhuge_sdk->sdk_config->api_path.c_str(), *request_headers, body, content_type);
+					this->connection_pool->EndRequest(index, static_cast<bool>(res));
+					const nanoseconds latency = steady_clock::now() - begin;
+
+					uploaded = res && res->status < 500;
+					status = res ? res->status : 0;
+					endpoint_name = endpoint.host + ":" + std::to_string(endpoint.port);
+					this->endpoint_selector.Release(index, uploaded, duration_cast<milliseconds>(latency).count());
+
+					metrics.upload_requests.Add(1);
+					metrics.bytes_sent.Add(body.size());
+					metrics.upload_latency.Record(latency.count());
+					if (!uploaded) {
+						metrics.upload_failures.Add(1);
+					}
 
-				auto res = cli.Post(this->zhuge_sdk->sdk_config->api_path.c_str(), headers, params);
+					if (!this->traced_batches.empty()) {
+						std::ostringstream detail;
+						detail << endpoint.host << ":" << endpoint.port;
+						if (res) {
+							detail << ", status code: " << res->status;
+						}
+						else {
+							detail << ", error_code: " << res.error();
+						}
+						const long long send_begin = duration_cast<nanoseconds>(begin.time_since_epoch()).count();
+						this->TraceUpload(itr, frame_batches, send_begin, send_begin + latency.count(), detail.str(), uploaded);
+					}
 
-				if (res) {
-					itr = all_data.erase(itr);
-					if (this->zhuge_sdk->sdk_config->enable_log) {
-						std::clog << "[ZhugeSDK] Upload Data success, status code: " << res->status << std::endl;
+					if (uploaded) {
+						ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_DEBUG, "Upload data to " << endpoint.host << ":" << endpoint.port
+							<< ", status code: " << res->status);
+					}
+					else if (res) {
+						ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_WARN, "Upload data to " << endpoint.host << ":" << endpoint.port
+							<< ", status code: " << res->status);
+					}
+					else {
+						ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_WARN, "Upload data to " << endpoint.host << ":" << endpoint.port
+							<< " error, error_code: " << res.error());
 					}
 				}
-				else {
-					itr++;
-					if (this->zhuge_sdk->sdk_config->enable_log) {
-						std::clog << "[ZhugeSDK] Upload error, error_code: " << res.error() << std::endl;
+
+				const ZhugeSDKUploadCallback& upload_callback = this->zhuge_sdk->sdk_config->upload_callback;
+				if (upload_callback) {
+					ZhugeSDKUploadResult result;
+					result.success = uploaded;
+					result.batches = frame_batches;
+					result.bytes = body.size();
+					result.status = status;
+					result.endpoint = endpoint_name;
+					upload_callback(result);
+				}
+
+				for (size_t i = 0; i < frame_batches; i++) {
+					if (uploaded) {
+						itr = all_data.erase(itr);
+					}
+					else {
+						itr++;
 					}
 				}
+				if (uploaded) {
+					metrics.batches_uploaded.Add(frame_batches);
+				}
 			}
+			this->UpdateSpoolMetrics(all_data);
+			const bool drained = this->data_storage->Drained();  // 文件存储在同步之后会清空缓冲
 
+			this->connection_pool->CloseAll();  // 上传周期结束，关闭连接
 			this->data_storage->Sync();  // 同步对数据存储的修改
-
+			return drained;
 		}
 		catch (std::exception& e) {
-			if (this->zhuge_sdk->sdk_config->enable_log) {
-				std::clog << "[ZhugeSDK] Exception happened when upload data: " << e.what() << std::endl;
-			}
+			ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_ERROR, "Exception happened when upload data: " << e.what());
+			return false;
 		}
 	}
 
 	void ZhugeSDKTaskProcess::HandleUploadData()
+	{
+		this->SerializeQueuedData();
+
+		// 执行数据上传
+		this->ResolveFlushMarkers(this->TransDataWithAPI());
+	}
+
+	// 序列化时每个租户的数据分别累积的批次
+	struct ZhugeTenantBatch
+	{
+		Json::Value data;
+		int count = 0;
+		std::vector<ZhugeTraceSpan> event_spans;  // 等待批次写入存储的事件追踪记录
+	};
+
+	void ZhugeSDKTaskProcess::SerializeQueuedData()
 	{
 		// 将任务队列中的数据尽快提取到本地，减少锁对埋点方法的影响
 		this->upload_data_queue.DequeueToBuffer(upload_data_buf);
+		const long long dequeue_time = this->zhuge_sdk->sdk_config->tracer ? ZhugeTraceNow() : 0;
+
+		// 展开批量上报的事件，每个事件使用批次的上报上下文
+		for (auto itr = this->upload_data_buf.begin(); itr != this->upload_data_buf.end();) {
+			if ((*itr)->GetDataType() != ZG_BATCH) {
+				itr++;
+				continue;
+			}
+			ZhugeEventBatch* batch = static_cast<ZhugeEventBatch*>(*itr);
+			for (auto event_ptr : batch->events) {
+				event_ptr->owner = batch->owner;
+				event_ptr->track_context = batch->context;
+				batch->context.trace = ZhugeTraceContext();  // 整批事件只追踪第一个事件
+				this->upload_data_buf.insert(itr, event_ptr);
+			}
+			itr = this->upload_data_buf.erase(itr);
+			delete batch;
+		}
 
 		if (!this->upload_data_buf.empty()) {
+			ZhugeSDKMetrics& metrics = this->zhuge_sdk->GetMetrics();
+			metrics.queue_depth.Add(-static_cast<long long>(this->upload_data_buf.size()));
+			const std::chrono::steady_clock::time_point serialize_begin = std::chrono::steady_clock::now();
 
-			int i = 0;
-			Json::Value data;
 			Json::FastWriter json_writer;
+			std::vector<ZhugeEvent*> recycled_events;
+			const bool count_queued = this->zhuge_sdk->sdk_config->max_queued_events > 0;
+
+			// 每个租户的数据分别组成批次，相邻的数据通常属于同一个租户，只在租户变化时查找
+			std::unordered_map<ZhugeSDK*, ZhugeTenantBatch> batches;
+			ZhugeSDK* owner = nullptr;
+			ZhugeTenantBatch* batch = nullptr;
 
 			for (auto element : this->upload_data_buf) {
-				data.append(element->GetJSONData());
-				if (i++ % this->zhuge_sdk->sdk_config->max_send_size == 0) {
-					Json::Value root;
-					root["data"] = data;
-					BuildFullUploadData(root);
-					data = Json::Value();
-					std::string json_str = json_writer.write(root);
-					this->data_storage->Save(json_str);
+				const char* data_type = element->GetDataType();
+				if (data_type == ZG_FLUSH) {  // 之前的数据都已经进入批次，本周期上传之后再通知
+					this->flush_markers.push_back(static_cast<ZhugeSDKFlushMarker*>(element));
+					continue;
+				}
+				if (element->owner != owner) {
+					owner = element->owner;
+					batch = &batches[owner];
+				}
+				if (data_type == ZG_EVT) {  // 填充用户ID与延迟填充的事件属性
+					if (count_queued) {
+						owner->queued_events.fetch_sub(1, std::memory_order_relaxed);  // 归还队列配额
+					}
+					ZhugeEvent* event_ptr = static_cast<ZhugeEvent*>(element);
+					if (event_ptr->track_context.trace.id != 0) {
+						this->EnrichTracedEvent(event_ptr, dequeue_time, batch->event_spans);
+					}
+					else {
+						owner->EnrichEvent(event_ptr);
+					}
+				}
+				if (data_type == ZG_PL) {  // 之后的事件使用新的平台属性
+					std::shared_ptr<ZhugePlatformAttributes> attributes = std::make_shared<ZhugePlatformAttributes>();
+					attributes->os = element->GetStringProperty(ZG_KEY_OS, "unknown");
+					attributes->ov = element->GetStringProperty(ZG_KEY_OV, "unknown");
+					owner->platform_attributes = attributes;
+				}
+				else if (data_type == ZG_SS && owner->platform_attributes) {
+					// 在序列化时填充操作系统信息，事件的操作系统信息由EnrichEvent填充
+					element->AddPropertyIfAbsent<const Json::Value&>(ZG_KEY_OS, owner->platform_attributes->os);
+					element->AddPropertyIfAbsent<const Json::Value&>(ZG_KEY_OV, owner->platform_attributes->ov);
+				}
+				element->MoveJSONDataTo(batch->data.append(Json::Value()));  // 上传之后不再使用，直接转移数据
+				if (batch->count++ % this->zhuge_sdk->sdk_config->max_send_size == 0) {
+					this->SaveBatch(owner, batch->data, batch->event_spans, json_writer);
 				}
 
-				if (element->GetDataType() != ZG_PL) {
+				if (element->GetDataType() == ZG_EVT && typeid(*element) == typeid(ZhugeEvent)) {
+					// 事件对象回收到对象池中重复使用
+					recycled_events.push_back(static_cast<ZhugeEvent*>(element));
+				}
+				else {
 					delete element;  // 释放上传数据的内存
 				}
 			}
+			this->zhuge_sdk->GetEventPool().ReleaseBatch(recycled_events);
 
-			if (!data.empty()) {
-				Json::Value root;
-				root["data"] = data;
-				BuildFullUploadData(root);
-				std::string json_str = json_writer.write(root);
-				this->data_storage->Save(json_str);
+			for (auto& pending : batches) {
+				if (!pending.second.data.empty()) {
+					this->SaveBatch(pending.first, pending.second.data, pending.second.event_spans, json_writer);
+				}
 			}
 
 			// 清理缓冲
 			this->upload_data_buf.clear();
+			metrics.serialize_latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - serialize_begin).count());
 		}
 
-		// 执行数据上传
-		this->TransDataWithAPI();
 	}
 
-	void ZhugeSDKTaskProcess::Process()
+	void ZhugeSDKTaskProcess::ResolveFlushMarkers(bool drained)
 	{
-		static int i = 0;
+		for (auto marker : this->flush_markers) {
+			marker->promise.set_value(drained);
+			delete marker;
+		}
+		this->flush_markers.clear();
+	}
 
-		while (true) {
-			if (this->zhuge_sdk->sdk_config->enable_log) {
-				std::clog << "[ZhugeSDK] Upload process running：" << i++ << std::endl;
-			}
+	long long ZhugeSDKTaskProcess::UploadBudgetMilliseconds()
+	{
+		const long long deadline = this->upload_deadline.load();
+		if (deadline == 0) {
+			return -1;  // 未在关闭中，或者关闭时不限时间
+		}
+		using namespace std::chrono;
+		const long long now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+		return deadline > now ? deadline - now : 0;
+	}
+
+	void ZhugeSDKTaskProcess::EnrichTracedEvent(
+		ZhugeEvent* event_ptr, long long dequeue_time, std::vector<ZhugeTraceSpan>& event_spans)
+	{
+		const ZhugeTraceContext trace = event_ptr->track_context.trace;
+		event_ptr->track_context.trace = ZhugeTraceContext();  // 事件对象可能被回收重用
 
-			this->HandleUploadData();
+		const long long enrich_begin = ZhugeTraceNow();
+		event_ptr->owner->EnrichEvent(event_ptr);
+		const long long enrich_end = ZhugeTraceNow();
 
-			if (this->stop_mark.load()) {
-				if (!this->upload_data_queue.empty()) {
-					this->HandleUploadData();
-				}
-				this->shutdown_promise.set_value();  // 通知处理线程已经关闭
-				if (this->zhuge_sdk->sdk_config->enable_log) {
-					std::clog << "[ZhugeSDK] Upload process stopped" << std::endl;
+		// 所在批次写入存储之后才能确定批次ID，先暂存
+		const std::string event_name = event_ptr->GetStringProperty(ZG_KEY_EID, "");
+		event_spans.push_back({ ZHUGE_TRACE_TRACK, trace.id, 0, trace.begin, trace.enqueue, event_name });
+		event_spans.push_back({ ZHUGE_TRACE_QUEUE_WAIT, trace.id, 0, trace.enqueue, dequeue_time, event_name });
+		event_spans.push_back({ ZHUGE_TRACE_ENRICH, trace.id, 0, enrich_begin, enrich_end, event_name });
+	}
+
+	void ZhugeSDKTaskProcess::SaveBatch(
+		ZhugeSDK* owner, Json::Value& data, std::vector<ZhugeTraceSpan>& event_spans, Json::FastWriter& json_writer)
+	{
+		// 只追踪包含被采样事件的批次
+		ZhugeSDKTracer* tracer = this->zhuge_sdk->sdk_config->tracer.get();
+		const bool traced = tracer && !event_spans.empty();
+		const long long serialize_begin = traced ? ZhugeTraceNow() : 0;
+
+		Json::Value root;
+		root["data"].swap(data);
+		BuildFullUploadData(owner, root);
+		data = Json::Value();
+		std::string json_str = json_writer.write(root);
+
+		if (!traced) {
+			this->data_storage->Save(json_str);
+			this->zhuge_sdk->GetMetrics().batches_saved.Add(1);
+			return;
+		}
+
+		const size_t batch_hash = std::hash<std::string>()(json_str);
+		const size_t batch_bytes = json_str.size();
+		const long long save_begin = ZhugeTraceNow();
+		this->data_storage->Save(json_str);
+		this->zhuge_sdk->GetMetrics().batches_saved.Add(1);
+		const long long save_end = ZhugeTraceNow();
+
+		const unsigned long long batch_id = this->zhuge_sdk->trace_id_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+		for (auto& span : event_spans) {
+			span.batch_id = batch_id;
+			tracer->Record(span);
+		}
+		event_spans.clear();
+		tracer->Record({ ZHUGE_TRACE_SERIALIZE, 0, batch_id, serialize_begin, save_begin,
+			std::to_string(root["data"].size()) + " events" });
+		tracer->Record({ ZHUGE_TRACE_SAVE, 0, batch_id, save_begin, save_end,
+			std::to_string(batch_bytes) + " bytes" });
+
+		if (this->traced_batches.size() >= ZHUGE_TRACE_MAX_PENDING_BATCHES) {
+			this->traced_batches.clear();
+		}
+		this->traced_batches[batch_hash] = { batch_id, save_end, false };
+	}
+
+	void ZhugeSDKTaskProcess::TraceUpload(
+		std::list<std::string>::iterator begin, size_t frame_batches,
+		long long send_begin, long long send_end, const std::string& detail, bool uploaded)
+	{
+		ZhugeSDKTracer* tracer = this->zhuge_sdk->sdk_config->tracer.get();
+		std::hash<std::string> hasher;
+		auto itr = begin;
+		for (size_t i = 0; i < frame_batches; i++, itr++) {
+			auto traced = this->traced_batches.find(hasher(*itr));
+			if (traced == this->traced_batches.end()) {
+				continue;
+			}
+			TracedBatch& batch = traced->second;
+			if (!batch.sent) {
+				tracer->Record({ ZHUGE_TRACE_SPOOL_WAIT, 0, batch.batch_id, batch.saved, send_begin, "" });
+				batch.sent = true;
+			}
+			tracer->Record({ ZHUGE_TRACE_SEND, 0, batch.batch_id, send_begin, send_end, detail });
+			if (uploaded) {
+				tracer->Record({ ZHUGE_TRACE_ACK, 0, batch.batch_id, send_end, send_end, "" });
+				this->traced_batches.erase(traced);
+			}
+		}
+	}
+
+	void ZhugeSDKTaskProcess::RunCycle(const std::shared_ptr<ZhugeSDKProcessHandle>& handle, unsigned long long generation)
+	{
+		ZhugeSDKTaskProcess* process;
+		{
+			// 任务中不等待其它周期结束，避免一个上传缓慢的SDK对象占用共享执行器的全部工作线程
+			std::lock_guard<std::mutex> lock(handle->mutex);
+			process = handle->process;
+			if (process == nullptr || process->stop_mark.load()) {  // 已经关闭，剩余的数据由Stop处理
+				return;
+			}
+			if (generation == 0) {  // 立即执行的周期，之后的唤醒需要重新提交
+				process->wake_pending.store(false);
+				if (handle->running) {  // 由正在执行的周期结束后重新提交
+					handle->rerun = true;
+					return;
 				}
-				break;
 			}
+			else if (handle->running || generation != process->cycle_generation) {
+				return;  // 定时任务已经被提前唤醒的周期取代，正在执行的周期结束后会提交新的定时任务
+			}
+			handle->running = true;
+		}
 
-			std::this_thread::sleep_for(
-				std::chrono::milliseconds(this->zhuge_sdk->sdk_config->process_interval_milliseconds));
+		ZHUGE_LOG(process->zhuge_sdk, ZHUGE_LOG_DEBUG, "Upload process running：" << process->cycle_generation);
+		process->HandleUploadData();
+
+		// 等待上传间隔之后执行下一个周期，Flush会提前唤醒；执行期间收到的唤醒立即重新提交。
+		// 在锁内决定提交的任务，释放锁之后再提交：执行器可以在当前线程中直接执行任务
+		std::shared_ptr<ZhugeSDKExecutor> executor;
+		bool rerun = false;
+		long long delay_milliseconds = 0;
+		unsigned long long next = 0;
+		{
+			std::unique_lock<std::mutex> lock(handle->mutex);
+			if (handle->abandoned) {
+				// Stop已经返回，在释放上传任务对象之前将剩余的数据写入磁盘
+				lock.unlock();
+				process->Drain();
+				lock.lock();
+			}
+			next = ++process->cycle_generation;
+			if (!process->stop_mark.load()) {
+				executor = process->executor;  // 提交期间上传任务对象可能被释放
+				rerun = handle->rerun;
+				delay_milliseconds = process->zhuge_sdk->sdk_config->process_interval_milliseconds;
+				handle->rescheduling++;
+			}
+			handle->rerun = false;
+			handle->running = false;
+		}
+		if (executor) {
+			if (rerun) {
+				executor->Execute([handle]{ RunCycle(handle, 0); });
+			}
+			else {
+				executor->ExecuteAfter(delay_milliseconds, [handle, next]{ RunCycle(handle, next); });
+			}
+			executor.reset();  // Stop在提交结束之后才会释放上传任务对象，执行器不会在自己的工作线程中析构
+			std::lock_guard<std::mutex> lock(handle->mutex);
+			handle->rescheduling--;
 		}
+		handle->cond.notify_all();
+	}
+
+	void ZhugeSDKTaskProcess::Drain()
+	{
+		// 将队列中剩余的数据写入存储，在上传时间内上传
+		this->state.store(ZHUGE_PROCESS_DRAINING);
+		this->SerializeQueuedData();
+		const bool drained = this->UploadBudgetMilliseconds() != 0 && this->TransDataWithAPI();
+		this->ResolveFlushMarkers(drained);
+
+		// 未上传的数据写入磁盘
+		this->state.store(ZHUGE_PROCESS_SPILLING);
+		this->data_storage->Spill();
+
+		this->state.store(ZHUGE_PROCESS_STOPPED);
+		ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_INFO, "Upload process stopped");
 	}
 
-	void ZhugeSDKTaskProcess::AddUploadDataToQueue(ZhugeSDKUploadData* upload_data)
+	void ZhugeSDKTaskProcess::AddUploadDataToQueue(ZhugeSDK* owner, ZhugeSDKUploadData* upload_data)
 	{
+		upload_data->owner = owner;
+		// 批量上报的事件按事件数计入队列长度
+		this->zhuge_sdk->GetMetrics().queue_depth.Add(upload_data->GetDataType() == ZG_BATCH ?
+			static_cast<ZhugeEventBatch*>(upload_data)->events.size() : 1);
 		this->upload_data_queue.Enqueue(upload_data);
 	}
 
+	std::future<bool> ZhugeSDKTaskProcess::Flush()
+	{
+		ZhugeSDKFlushMarker* marker = new ZhugeSDKFlushMarker();
+		std::future<bool> result = marker->promise.get_future();
+		{
+			// 与Stop互斥：标记要么在Stop处理队列之前入队，要么看到已经关闭，不会滞留到析构时才被通知
+			std::lock_guard<std::mutex> lock(this->stop_mutex);
+			if (!this->stop_mark.load()) {
+				this->AddUploadDataToQueue(this->zhuge_sdk, marker);
+				marker = nullptr;
+			}
+		}
+		if (marker != nullptr) {  // 上传任务已经终止
+			marker->promise.set_value(false);
+			delete marker;
+			return result;
+		}
+		this->Wake();
+		return result;
+	}
+
+	void ZhugeSDKTaskProcess::Wake()
+	{
+		if (this->state.load() != ZHUGE_PROCESS_RUNNING) {  // 尚未启动时由Run提交第一个周期
+			return;
+		}
+		if (this->wake_pending.exchange(true)) {  // 已经有等待执行的上传周期
+			return;
+		}
+		std::shared_ptr<ZhugeSDKProcessHandle> handle = this->handle;
+		this->executor->Execute([handle]{ RunCycle(handle, 0); });
+	}
+
 	void ZhugeSDKTaskProcess::Run()
 	{
-		std::thread t([this]{this->Process(); });
-		t.detach();
+		this->state.store(ZHUGE_PROCESS_RUNNING);
+		this->Wake();  // 启动时立即执行一个周期，上传上次遗留的数据
 	}
 
 	void ZhugeSDKTaskProcess::Stop(int timeout)
 	{
+		using namespace std::chrono;
+		std::lock_guard<std::mutex> lock(this->stop_mutex);
+		if (this->state.load() != ZHUGE_PROCESS_RUNNING) {  // 未启动或已经关闭
+			this->stop_mark.store(true);
+			return;
+		}
+
+		// 前4/5的时间用于上传，剩余的时间用于写入磁盘
+		const steady_clock::time_point now = steady_clock::now();
+		const steady_clock::time_point stop_deadline = now + milliseconds(timeout > 0 ? timeout : 0);
+		const steady_clock::time_point upload_deadline = now + milliseconds(timeout > 0 ? timeout * 4 / 5 : 0);
+		this->upload_deadline.store(std::max<long long>(
+			1, duration_cast<milliseconds>(upload_deadline.time_since_epoch()).count()));
 		this->stop_mark.store(true);
-		std::future<void> shutdown_future(this->shutdown_promise.get_future());
-		shutdown_future.wait_for(std::chrono::milliseconds(timeout));
+		this->rate_limiter.Cancel();  // 唤醒等待限速的上传，之后的请求超时不超过剩余的上传时间
+
+		// 等待进行中的上传周期结束，到时仍未结束则中断进行中的请求，尽快开始写入磁盘
+		{
+			ZhugeSDKProcessHandle& handle = *this->handle;
+			std::unique_lock<std::mutex> cycle_lock(handle.mutex);
+			if (!handle.cond.wait_until(cycle_lock, upload_deadline, [&handle]{ return !handle.running; })) {
+				this->connection_pool->Interrupt();
+				if (!handle.cond.wait_until(cycle_lock, stop_deadline, [&handle]{ return !handle.running; })) {
+					// 周期仍未结束（例如阻塞在域名解析中），不再等待：由该周期结束时写入磁盘，析构时等待其结束
+					handle.abandoned = true;
+					this->state.store(ZHUGE_PROCESS_DRAINING);
+					ZHUGE_LOG(this->zhuge_sdk, ZHUGE_LOG_WARN, "Upload cycle not stopped in " << timeout
+						<< " ms, remaining data will be spilled when it ends");
+					return;
+				}
+			}
+		}
+		this->Drain();
 	}
 
 	void ZhugeSDKTaskProcess::Stop()
 	{
+		std::lock_guard<std::mutex> lock(this->stop_mutex);
 		this->stop_mark.store(true);
-		std::future<void> shutdown_future(this->shutdown_promise.get_future());
-		shutdown_future.get();
+		if (this->state.load() != ZHUGE_PROCESS_RUNNING) {  // 未启动或已经关闭
+			return;
+		}
+		{
+			// 等待进行中的上传周期结束，之后的周期任务会因为stop_mark直接返回
+			ZhugeSDKProcessHandle& handle = *this->handle;
+			std::unique_lock<std::mutex> cycle_lock(handle.mutex);
+			handle.cond.wait(cycle_lock, [&handle]{ return !handle.running; });
+		}
+		this->Drain();
+	}
+
+	ZhugeSDKProcessState ZhugeSDKTaskProcess::GetState()
+	{
+		return static_cast<ZhugeSDKProcessState>(this->state.load());
+	}
+
+	void ZhugeSDKTaskProcess::UpdateSpoolMetrics(const std::list<std::string>& all_data)
+	{
+		long long spool_bytes = 0;
+		for (auto& batch : all_data) {
+			spool_bytes += batch.size();
+		}
+		ZhugeSDKMetrics& metrics = this->zhuge_sdk->GetMetrics();
+		metrics.spool_batches.Set(all_data.size());
+		metrics.spool_bytes.Set(spool_bytes);
+	}
+
+	ZhugeSDKTLSStats ZhugeSDKTaskProcess::GetTLSStats()
+	{
+		return this->connection_pool->GetTLSStats();
 	}
 
 	ZhugeSDKTaskProcess::~ZhugeSDKTaskProcess()
 	{
+		if (this->state.load() == ZHUGE_PROCESS_RUNNING) {
+			this->Stop(0);  // 未关闭就析构时不再上传，只将数据写入磁盘
+		}
+		{
+			// 等待被Stop放弃等待的周期写入磁盘，以及正在提交下一个周期的任务结束
+			std::unique_lock<std::mutex> lock(this->handle->mutex);
+			this->handle->cond.wait(lock, [this]{ return this->handle->Idle(); });
+			this->handle->process = nullptr;  // 执行器中剩余的任务不再访问该对象
+		}
+
+		// 释放关闭之后才入队的数据
+		this->upload_data_queue.DequeueToBuffer(this->upload_data_buf);
+		for (auto element : this->upload_data_buf) {
+			if (element->GetDataType() == ZG_FLUSH) {
+				static_cast<ZhugeSDKFlushMarker*>(element)->promise.set_value(false);
+			}
+			else if (element->GetDataType() == ZG_BATCH) {
+				for (auto event_ptr : static_cast<ZhugeEventBatch*>(element)->events) {
+					delete event_ptr;
+				}
+			}
+			delete element;
+		}
+		delete this->connection_pool;
 		delete this->data_storage;
 	}
 
@@ -518,13 +2561,151 @@ namespace zhugeio
 
 	// ZhugeSDK方法实现
 
+	// ZhugeSDKClock方法实现
+
+	ZhugeSDKClock::ZhugeSDKClock(int resolution_milliseconds) :
+		resolution_milliseconds(resolution_milliseconds),
+		stop_mark(false)
+	{
+		this->Refresh();
+		if (this->resolution_milliseconds > 0) {
+			this->tick_thread = std::thread([this]{this->Tick(); });
+		}
+	}
+
+	void ZhugeSDKClock::Refresh()
+	{
+		using namespace std::chrono;
+		this->cached_milliseconds.store(duration_cast<milliseconds>(
+			system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+		this->cached_steady_milliseconds.store(duration_cast<milliseconds>(
+			steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+	}
+
+	void ZhugeSDKClock::Tick()
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (!this->stop_cv.wait_for(lock, std::chrono::milliseconds(this->resolution_milliseconds),
+			[this]{ return this->stop_mark; })) {
+			this->Refresh();
+		}
+	}
+
+	void ZhugeSDKClock::Stamp(const std::vector<ZhugeEvent*>& events)
+	{
+		const long long ts = this->Now();
+		for (auto event_ptr : events) {
+			event_ptr->AddPropertyIfAbsent(ZG_KEY_CT, ts);
+		}
+	}
+
+	ZhugeSDKClock::~ZhugeSDKClock()
+	{
+		if (this->tick_thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->stop_mark = true;
+			}
+			this->stop_cv.notify_all();
+			this->tick_thread.join();
+		}
+	}
+
+	// SDK对象序号
+	static std::atomic<unsigned long long> sdk_instance_id_seq(0);
+
 	ZhugeSDK::ZhugeSDK(ZhugeSDKConfig* zhuge_sdk_config) :
+		host(this),
+		app_key(zhuge_sdk_config->app_key),
+		upload_process(nullptr),
+		event_pool(DEFAULT_EVENT_POOL_SIZE),
+		clock(zhuge_sdk_config->clock_resolution_milliseconds),
 		sdk_config(zhuge_sdk_config)
 	{
-		this->user_id = "";
+		this->queued_events.store(0);
 		this->stopped.store(false);
-		this->platform_info = nullptr;
+		this->metrics_server = nullptr;
+		this->trace_id_seq.store(0);
+		this->logger = zhuge_sdk_config->logger;
+		if (!this->logger && zhuge_sdk_config->enable_log) {
+			this->logger = std::make_shared<ZhugeSDKAsyncLogger>();
+		}
+		this->session_id.store(0);
+		this->common_properties = std::make_shared<ZhugeCommonProperties>();
+		this->context_version.store(1);  // 线程本地缓存项的版本0表示尚未读取
+		this->instance_id = ++sdk_instance_id_seq;
+	}
+
+	ZhugeSDK::ZhugeSDK(ZhugeSDK* host, const std::string& app_key) :
+		host(host),
+		app_key(app_key),
+		upload_process(host->upload_process),
+		event_pool(0),  // 使用所属SDK对象的事件对象池与时钟，不创建时钟刷新线程
+		clock(0),
+		sdk_config(host->sdk_config)
+	{
+		this->queued_events.store(0);
+		this->stopped.store(host->stopped.load());
+		this->metrics_server = nullptr;
+		this->trace_id_seq.store(0);
+		this->logger = host->logger;
 		this->session_id.store(0);
+		this->common_properties = std::make_shared<ZhugeCommonProperties>();
+		this->context_version.store(1);  // 线程本地缓存项的版本0表示尚未读取
+		this->instance_id = ++sdk_instance_id_seq;
+	}
+
+	ZhugeSDK* ZhugeSDK::Tenant(const std::string& app_key)
+	{
+		if (this->host != this) {
+			return this->host->Tenant(app_key);
+		}
+		if (app_key == this->app_key) {
+			return this;
+		}
+		if (this->upload_process == nullptr) {
+			throw ZhugeSDKException("Tenant must be created after StartProcess!");
+		}
+
+		std::lock_guard<std::mutex> lock(this->tenants_mutex);
+		ZhugeSDK*& tenant = this->tenants[app_key];
+		if (tenant == nullptr) {
+			tenant = new ZhugeSDK(this, app_key);
+			ZHUGE_LOG(this, ZHUGE_LOG_INFO, "Tenant created, app_key = " << app_key);
+		}
+		return tenant;
+	}
+
+	bool ZhugeSDK::AcquireQueueQuota(size_t events, ZhugeEventPriority priority)
+	{
+		if (priority == ZHUGE_EVENT_LOW && this->SpoolOverloaded()) {  // 上传已经积压，优先丢弃低优先级事件
+			return false;
+		}
+		const size_t max_queued_events = this->sdk_config->max_queued_events;
+		if (max_queued_events == 0) {
+			return true;
+		}
+		if (priority == ZHUGE_EVENT_CRITICAL) {  // 关键事件只计入配额，不会被丢弃
+			this->queued_events.fetch_add(events, std::memory_order_relaxed);
+			return true;
+		}
+		// 低优先级事件只能使用一半的配额，为普通事件与关键事件保留余量
+		const size_t limit = priority == ZHUGE_EVENT_LOW ? max_queued_events / 2 : max_queued_events;
+		if (this->queued_events.fetch_add(events, std::memory_order_relaxed) + events > limit) {
+			this->queued_events.fetch_sub(events, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	bool ZhugeSDK::SpoolOverloaded()
+	{
+		// 文件存储没有总量上限，只有内存存储会在写满时整批丢弃数据
+		if (!this->sdk_config->storage_file_path.empty()) {
+			return false;
+		}
+		const long long max_records = this->sdk_config->max_storage_records;
+		return max_records > 0 && this->host->metrics.spool_batches.Value() * 2 >= max_records;
 	}
 
 	std::string ZhugeSDK::GenDeviceID()
@@ -571,26 +2752,58 @@ namespace zhugeio
 
 	void ZhugeSDK::StartProcess()
 	{
+		if (this->host != this) {  // 租户共用所属SDK对象的上传线程
+			return;
+		}
+
 		// 如果用户没有显式指定设备ID，则根据平台自动计算设备ID
 		if (this->sdk_config->user_device_id.empty()) {
-			if (this->sdk_config->enable_log) {
-				std::clog << "[ZhugeSDK] Use SDK device ID" << std::endl;
-			}
+			ZHUGE_LOG(this, ZHUGE_LOG_INFO, "Use SDK device ID");
 			this->auto_device_id = GenDeviceID();
-			if (this->sdk_config->enable_log) {
-				std::clog << "[ZhugeSDK] SDK generated device ID: " << auto_device_id << std::endl;
-			}
+			ZHUGE_LOG(this, ZHUGE_LOG_INFO, "SDK generated device ID: " << auto_device_id);
 		}
 		this->upload_process = new ZhugeSDKTaskProcess(this);
 		upload_process->Run();
+
+		if (this->sdk_config->metrics_port > 0) {  // 开启Prometheus指标接口
+			this->metrics_server = new ZhugeSDKMetricsServer(this);
+		}
 	}
 
 	const std::string& ZhugeSDK::GetDeviceID()
 	{
+		if (this->host != this) {
+			return this->host->GetDeviceID();
+		}
 		if (this->sdk_config->user_device_id.empty()) {
 			return this->auto_device_id;
 		}
-		return this->sdk_config->user_device_id;
+		return this->sdk_config->user_device_id;
+	}
+
+	void ZhugeSDK::PublishCommonProperties()
+	{
+		std::shared_ptr<ZhugeCommonProperties> snapshot = std::make_shared<ZhugeCommonProperties>();
+		std::vector<std::pair<ZhugePropertyKey, Json::Value>> late_properties;
+		for (auto& member : this->common_system_properties.getMemberNames()) {
+			ZhugePropertyKey key = ZhugePropertyKeys::System(member);
+			if (&key.Name() == &ZG_KEY_CUID.Name() || &key.Name() == &ZG_KEY_OS.Name() || &key.Name() == &ZG_KEY_OV.Name()) {
+				late_properties.push_back(std::make_pair(key, this->common_system_properties[member]));
+				continue;
+			}
+			snapshot->properties.push_back(std::make_pair(key, this->common_system_properties[member]));
+		}
+		for (auto& member : this->common_custom_properties.getMemberNames()) {
+			snapshot->properties.push_back(std::make_pair(
+				ZhugePropertyKeys::Custom(member), this->common_custom_properties[member]));
+		}
+		snapshot->late_begin = snapshot->properties.size();
+		for (auto& property : late_properties) {  // 与cuid、os、ov同名的属性放在最后
+			snapshot->properties.push_back(std::move(property));
+		}
+		std::atomic_store(
+			&this->common_properties, std::shared_ptr<const ZhugeCommonProperties>(snapshot));
+		this->context_version.fetch_add(1, std::memory_order_release);  // 发布之后再增加版本
 	}
 
 	void ZhugeSDK::SetCommonEventSystemProperties(Json::Value& common_system_properties)
@@ -599,17 +2812,15 @@ namespace zhugeio
 			return;
 		}
 
+		std::lock_guard<std::mutex> lock(this->common_properties_mutex);
 		auto members = common_system_properties.getMemberNames();
 		for (auto member : members) {
 			this->common_system_properties[member] = common_system_properties[member];
 		}
+		this->PublishCommonProperties();
 
-		if (this->sdk_config->enable_log) {
-			std::clog
-				<< "[ZhugeSDK] Common sys event properties setted: "
-				<< this->common_custom_properties.toStyledString()
-				<< std::endl;
-		}
+		ZHUGE_LOG(this, ZHUGE_LOG_DEBUG, "Common sys event properties setted: "
+			<< this->common_system_properties.toStyledString());
 	}
 
 	void ZhugeSDK::SetCommonEventCustomProperties(Json::Value& common_custom_properties)
@@ -618,38 +2829,41 @@ namespace zhugeio
 			return;
 		}
 
+		std::lock_guard<std::mutex> lock(this->common_properties_mutex);
 		auto members = common_custom_properties.getMemberNames();
 		for (auto member : members) {
 			this->common_custom_properties[member] = common_custom_properties[member];
 		}
-		if (this->sdk_config->enable_log) {
-			std::clog
-				<< "[ZhugeSDK] Common cus event properties setted: "
-				<< this->common_custom_properties.toStyledString()
-				<< std::endl;
-		}
+		this->PublishCommonProperties();
+
+		ZHUGE_LOG(this, ZHUGE_LOG_DEBUG, "Common cus event properties setted: "
+			<< this->common_custom_properties.toStyledString());
 	}
 
 	void ZhugeSDK::Identify(ZhugeUser* user_ptr)
 	{
-		if (this->stopped.load()) {
+		if (this->stopped.load()) {  // SDK已经关闭，数据由SDK负责释放
+			delete user_ptr;
 			return;
 		}
 
-		user_ptr->AddSystemPropertyIfAbsent("tz", this->sdk_config->time_zone); // 完善时区属性
-		if (!user_ptr->HasSystemProperty("ct")) {
-			using namespace std::chrono;
-			const long long ts = duration_cast<milliseconds>(
-				system_clock::now().time_since_epoch()).count();
-			user_ptr->AddSystemProperty("ct", ts);
+		user_ptr->AddPropertyIfAbsent(ZG_KEY_TZ, this->sdk_config->time_zone); // 完善时区属性
+		if (!user_ptr->HasProperty(ZG_KEY_CT)) {
+			user_ptr->AddProperty(ZG_KEY_CT, this->GetClock().Now());
+		}
+		std::shared_ptr<const std::string> user_id;
+		if (!user_ptr->GetUserId().empty()) {
+			user_id = std::make_shared<const std::string>(user_ptr->GetUserId());
 		}
-		this->user_id = user_ptr->GetUserId();
-		this->upload_process->AddUploadDataToQueue(user_ptr);
+		std::atomic_store(&this->user_id, user_id);
+		this->context_version.fetch_add(1, std::memory_order_release);
+		this->upload_process->AddUploadDataToQueue(this, user_ptr);
 	}
 
 	void ZhugeSDK::CleanUserId()
 	{
-		this->user_id = "";
+		std::atomic_store(&this->user_id, std::shared_ptr<const std::string>());
+		this->context_version.fetch_add(1, std::memory_order_release);
 	}
 
 	// 获取系统当前语言信息
@@ -736,22 +2950,22 @@ namespace zhugeio
 
 		const std::string lang = GetSystemLanguage();
 		if (!lang.empty()) {
-			platform_ptr->AddSystemProperty("lang", GetSystemLanguage()); // 语言
+			platform_ptr->AddProperty(ZG_KEY_LANG, GetSystemLanguage()); // 语言
 		}
 
 		const std::string rs = GetScreenResolving();
 		if (!rs.empty()) {
-			platform_ptr->AddSystemProperty("rs", rs);  // 分辨率
+			platform_ptr->AddProperty(ZG_KEY_RS, rs);  // 分辨率
 		}
 
 		const std::string os = GetOSName();
 		if (!os.empty()) {
-			platform_ptr->AddSystemProperty("os", GetOSName());   // OS
+			platform_ptr->AddProperty(ZG_KEY_OS, GetOSName());   // OS
 		}
 
 		const std::string os_version = GetOSVersion();
 		if (!os_version.empty()) {
-			platform_ptr->AddSystemProperty("ov", os_version);
+			platform_ptr->AddProperty(ZG_KEY_OV, os_version);
 		}
 
 		return platform_ptr;
@@ -759,26 +2973,22 @@ namespace zhugeio
 
 	void ZhugeSDK::Platform(ZhugePlatform* platform_ptr)
 	{
-		if (this->stopped.load()) {
+		if (this->stopped.load()) {  // SDK已经关闭，数据由SDK负责释放
+			delete platform_ptr;
 			return;
 		}
 
-		if (!this->user_id.empty()) {
-			platform_ptr->AddSystemPropertyIfAbsent("cuid", this->user_id);  // 设置$cuid
+		std::shared_ptr<const std::string> user_id = std::atomic_load(&this->user_id);
+		if (user_id) {
+			platform_ptr->AddPropertyIfAbsent(ZG_KEY_CUID, *user_id);  // 设置$cuid
 		}
 
-		platform_ptr->AddSystemPropertyIfAbsent("tz", this->sdk_config->time_zone); // 完善时区属性
+		platform_ptr->AddPropertyIfAbsent(ZG_KEY_TZ, this->sdk_config->time_zone); // 完善时区属性
 
-		if (!platform_ptr->HasSystemProperty("ct")) {
-			using namespace std::chrono;
-			const long long ts = duration_cast<milliseconds>(
-				system_clock::now().time_since_epoch()).count();
-			platform_ptr->AddSystemProperty("ct", ts);  // 加入当前时间戳
+		if (!platform_ptr->HasProperty(ZG_KEY_CT)) {
+			platform_ptr->AddProperty(ZG_KEY_CT, this->GetClock().Now());  // 加入当前时间戳
 		}
-		ZhugePlatform *old_platform = this->platform_info;
-		this->platform_info = platform_ptr;
-		delete old_platform;
-		this->upload_process->AddUploadDataToQueue(platform_ptr);
+		this->upload_process->AddUploadDataToQueue(this, platform_ptr);
 	}
 
 	void ZhugeSDK::StartSession()
@@ -789,25 +2999,17 @@ namespace zhugeio
 
 		std::unique_lock<std::mutex> lock(this->session_mutex);
 
-		using namespace std::chrono;
-		this->session_id.store(duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count());
+		this->session_id.store(this->GetClock().Now());
 		ZhugeSessionStart* session_start = new ZhugeSessionStart(this->session_id.load());
-		if (!this->user_id.empty()) {  // 设置$cuid
-			session_start->AddSystemProperty("cuid", this->user_id);
+		std::shared_ptr<const std::string> user_id = std::atomic_load(&this->user_id);
+		if (user_id) {  // 设置$cuid
+			session_start->AddProperty(ZG_KEY_CUID, *user_id);
 		}
-		session_start->AddSystemProperty("tz", this->sdk_config->time_zone);  // 设置时区
-		session_start->AddSystemProperty("ct", session_id.load());  // 事件时间与会话ID一致
+		session_start->AddProperty(ZG_KEY_TZ, this->sdk_config->time_zone);  // 设置时区
+		session_start->AddProperty(ZG_KEY_CT, session_id.load());  // 事件时间与会话ID一致
+		// 操作系统信息由上传线程在序列化时填充
 
-		// 操作系统信息
-		if (!session_start->HasSystemProperty("os") && this->platform_info != nullptr) {
-			session_start->AddSystemProperty("os", platform_info->GetSystemStringProperty("os", "unknown"));
-		}
-		if (!session_start->HasSystemProperty("ov") && this->platform_info != nullptr) {
-			session_start->AddSystemProperty("ov", platform_info->GetSystemStringProperty("ov", "unknown"));
-		}
-
-		this->upload_process->AddUploadDataToQueue(session_start);
+		this->upload_process->AddUploadDataToQueue(this, session_start);
 	}
 
 	void ZhugeSDK::StopSession()
@@ -823,73 +3025,331 @@ namespace zhugeio
 			return;
 		}
 
-		using namespace std::chrono;
-		const long long now = duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count();
+		const long long now = this->GetClock().Now();
 
 		if (now < session_id) {  // 当前会话ID不合法
 			return;
 		}
 
 		ZhugeSessionEnd* session_end = new ZhugeSessionEnd(this->session_id.load());
-		if (!this->user_id.empty()) {  // 设置$cuid
-			session_end->AddSystemPropertyIfAbsent("cuid", this->user_id);
+		std::shared_ptr<const std::string> user_id = std::atomic_load(&this->user_id);
+		if (user_id) {  // 设置$cuid
+			session_end->AddPropertyIfAbsent(ZG_KEY_CUID, *user_id);
 		}
 
-		session_end->AddSystemPropertyIfAbsent("tz", this->sdk_config->time_zone);  // 设置时区
+		session_end->AddPropertyIfAbsent(ZG_KEY_TZ, this->sdk_config->time_zone);  // 设置时区
 
-		session_end->AddSystemPropertyIfAbsent("ct", session_id);  // 事件时间与会话ID一致
+		session_end->AddPropertyIfAbsent(ZG_KEY_CT, session_id);  // 事件时间与会话ID一致
 
-		session_end->AddSystemPropertyIfAbsent("dru", now - session_id);  // 计算会话时长
+		session_end->AddPropertyIfAbsent(ZG_KEY_DRU, now - session_id);  // 计算会话时长
 
 		this->session_id.store(0);
-		this->upload_process->AddUploadDataToQueue(session_end);
+		this->upload_process->AddUploadDataToQueue(this, session_end);
+	}
+
+	// 每个线程的Track调用次数，用于对Track耗时采样
+	thread_local unsigned int track_sample_counter = 0;
+
+	// 每个线程的上报次数，用于追踪采样
+	thread_local unsigned int trace_sample_counter = 0;
+
+	// 每个线程的事件采样随机数，第一次使用时以线程的地址与时钟作为种子
+	thread_local std::minstd_rand event_sample_random(static_cast<std::minstd_rand::result_type>(
+		reinterpret_cast<uintptr_t>(&trace_sample_counter) ^ std::chrono::steady_clock::now().time_since_epoch().count()));
+
+	// 按采样率决定是否上报
+	static bool ZhugeSampleEvent(double sample_rate)
+	{
+		if (sample_rate >= 1) {
+			return true;
+		}
+		const std::minstd_rand::result_type value = event_sample_random() - std::minstd_rand::min();
+		return value < sample_rate * (std::minstd_rand::max() - std::minstd_rand::min());
+	}
+
+	bool ZhugeSDK::AdmitEvent(ZhugeEvent& event)
+	{
+		if (this->sdk_config->event_policies.empty()) {  // 未配置策略时不读取事件名称
+			return this->AdmitEvent(std::string());
+		}
+		return this->AdmitEvent(event.GetStringProperty(ZG_KEY_EID, ""));
+	}
+
+	bool ZhugeSDK::AdmitEvent(const std::string& event_name)
+	{
+		ZhugeEventPriority priority = ZHUGE_EVENT_NORMAL;
+		const std::unordered_map<std::string, ZhugeEventPolicy>& policies = this->sdk_config->event_policies;
+		if (!policies.empty()) {
+			const std::unordered_map<std::string, ZhugeEventPolicy>::const_iterator policy = policies.find(event_name);
+			if (policy != policies.end()) {
+				priority = policy->second.priority;
+				if (priority != ZHUGE_EVENT_CRITICAL && !ZhugeSampleEvent(policy->second.sample_rate)) {
+					this->metrics.events_sampled.Add(1);
+					return false;
+				}
+			}
+		}
+		if (!this->AcquireQueueQuota(1, priority)) {  // 超过队列配额或者上传积压
+			this->metrics.events_dropped.Add(1);
+			return false;
+		}
+		return true;
 	}
 
 	void ZhugeSDK::Track(ZhugeEvent* event_ptr)
 	{
 		if (this->stopped.load()) {  // SDK已经暂停
+			this->metrics.events_dropped.Add(1);
+		}
+		else if (this->AdmitEvent(*event_ptr)) {
+			this->EnqueueEvent(event_ptr);
 			return;
 		}
+		// 被丢弃的事件对象归还对象池
+		if (typeid(*event_ptr) == typeid(ZhugeEvent)) {
+			this->GetEventPool().Release(event_ptr);
+		}
+		else {
+			delete event_ptr;
+		}
+	}
 
-		if (!this->user_id.empty()) {
-			event_ptr->AddSystemPropertyIfAbsent("cuid", this->user_id);  // 添加cuid
+	void ZhugeSDK::DiscardEvents(std::vector<ZhugeEvent*>& events)
+	{
+		// 与上传线程回收事件对象时相同，对象池只保存ZhugeEvent对象
+		size_t pooled = 0;
+		for (auto event_ptr : events) {
+			if (typeid(*event_ptr) == typeid(ZhugeEvent)) {
+				events[pooled++] = event_ptr;
+			}
+			else {
+				delete event_ptr;
+			}
+		}
+		events.resize(pooled);
+		if (!events.empty()) {
+			this->GetEventPool().ReleaseBatch(events);
 		}
+	}
 
-		const long long session_id = this->session_id.load();
-		if (session_id != 0) {
-			event_ptr->AddSystemPropertyIfAbsent("sid", session_id);  // 添加会话ID
+	void ZhugeSDK::EnqueueEvent(ZhugeEvent* event_ptr)
+	{
+		using namespace std::chrono;
+		const bool sampled = (track_sample_counter++ & (ZHUGE_TRACK_LATENCY_SAMPLE_INTERVAL - 1)) == 0;
+		const steady_clock::time_point begin = sampled ? steady_clock::now() : steady_clock::time_point();
+
+		ZhugeTrackContext context;
+		this->CaptureTrackContext(context);
+		this->PrepareEvent(event_ptr, context);
+		if (event_ptr->track_context.trace.id != 0) {
+			event_ptr->track_context.trace.enqueue = ZhugeTraceNow();
+		}
+		this->upload_process->AddUploadDataToQueue(this, event_ptr);
+
+		this->metrics.events_tracked.Add(1);
+		if (sampled) {
+			this->metrics.track_latency.Record(duration_cast<nanoseconds>(steady_clock::now() - begin).count());
+		}
+	}
+
+	void ZhugeSDK::TrackBatch(std::vector<ZhugeEvent*> events)
+	{
+		if (this->stopped.load() ||  // SDK已经暂停，或者未配置事件策略时整批超过队列配额
+			(this->sdk_config->event_policies.empty() && !this->AcquireQueueQuota(events.size(), ZHUGE_EVENT_NORMAL))) {
+			this->metrics.events_dropped.Add(events.size());
+			this->DiscardEvents(events);
+			return;
+		}
+		if (!this->sdk_config->event_policies.empty()) {
+			// 逐个事件按采样率与优先级决定是否接收，关键事件不会因为整批超过配额而被丢弃
+			size_t admitted = 0;
+			std::vector<ZhugeEvent*> rejected;
+			for (auto event_ptr : events) {
+				if (this->AdmitEvent(*event_ptr)) {
+					events[admitted++] = event_ptr;
+				}
+				else {
+					rejected.push_back(event_ptr);
+				}
+			}
+			events.resize(admitted);
+			if (!rejected.empty()) {  // 被丢弃的事件对象归还对象池
+				this->DiscardEvents(rejected);
+			}
+			if (events.empty()) {
+				return;
+			}
+		}
+		this->metrics.events_tracked.Add(events.size());
+
+		// 整批事件共用同一个上下文，只读取一次时钟与快照，属性由上传线程填充
+		ZhugeEventBatch* batch = new ZhugeEventBatch(std::move(events));
+		this->CaptureTrackContext(batch->context);
+		batch->context.deferred = true;
+		if (batch->context.trace.id != 0) {
+			batch->context.trace.enqueue = ZhugeTraceNow();
+		}
+		this->upload_process->AddUploadDataToQueue(this, batch);
+	}
+
+	// 线程本地的用户ID与通用属性快照缓存
+	// 以SDK对象的序号为键，读取到的版本与SDK对象当前的版本相同时直接复制缓存的快照，
+	// 只增加引用计数，不经过std::atomic_load的全局锁
+	struct ZhugeContextThreadCache
+	{
+		struct Entry
+		{
+			unsigned long long instance_id;
+			unsigned long long version;
+			std::shared_ptr<const std::string> user_id;
+			std::shared_ptr<const ZhugeCommonProperties> common_properties;
+		};
+		std::vector<Entry> entries;  // 一个线程通常只向少数几个SDK对象上报，顺序查找即可
+		size_t next_victim = 0;  // 缓存已满时轮流替换的位置
+
+		// 获取SDK对象在当前线程的缓存，没有时替换一个缓存项，版本置为0
+		Entry& Of(unsigned long long instance_id)
+		{
+			for (auto& entry : this->entries) {
+				if (entry.instance_id == instance_id) {
+					return entry;
+				}
+			}
+			if (this->entries.size() < DEFAULT_CONTEXT_THREAD_CACHE_SIZE) {
+				this->entries.push_back(Entry());
+				this->entries.back().instance_id = instance_id;
+				this->entries.back().version = 0;
+				return this->entries.back();
+			}
+			Entry& entry = this->entries[this->next_victim++ % this->entries.size()];
+			entry.instance_id = instance_id;
+			entry.version = 0;
+			return entry;
+		}
+	};
+
+	thread_local ZhugeContextThreadCache context_thread_cache;
+
+	void ZhugeSDK::CaptureTrackContext(ZhugeTrackContext& context)
+	{
+		if (this->sdk_config->tracer) {
+			const int interval = this->sdk_config->trace_sample_interval;
+			if (interval <= 1 || trace_sample_counter++ % interval == 0) {
+				context.trace.id = this->host->trace_id_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+				context.trace.begin = ZhugeTraceNow();
+			}
+		}
+		context.ct = this->GetClock().Now();
+		context.sid = this->session_id.load();
+		const unsigned long long version = this->context_version.load(std::memory_order_acquire);
+		ZhugeContextThreadCache::Entry& cached = context_thread_cache.Of(this->instance_id);
+		if (cached.version != version) {
+			// 先读取版本再读取快照，快照不会比记录的版本旧，版本再次变化时重新读取
+			cached.user_id = std::atomic_load(&this->user_id);
+			cached.common_properties = std::atomic_load(&this->common_properties);
+			cached.version = version;
+		}
+		context.user_id = cached.user_id;
+		context.common_properties = cached.common_properties;
+	}
+
+	void ZhugeSDK::PrepareEvent(ZhugeEvent* event_ptr, const ZhugeTrackContext& context)
+	{
+		if (this->sdk_config->deferred_enrichment) {
+			// 只记录上下文，属性由上传线程填充
+			event_ptr->track_context = context;
+			event_ptr->track_context.deferred = true;
+			return;
+		}
+
+		// 只引用当前的用户ID，由上传线程在序列化时添加cuid
+		event_ptr->track_context.user_id = context.user_id;
+		event_ptr->track_context.trace = context.trace;
+
+		if (context.sid != 0) {
+			event_ptr->AddPropertyIfAbsent(ZG_KEY_SID, context.sid);  // 添加会话ID
+		}
+
+		event_ptr->AddPropertyIfAbsent(ZG_KEY_TZ, this->sdk_config->time_zone); // 完善时区属性
+
+		event_ptr->AddPropertyIfAbsent(ZG_KEY_CT, context.ct);  //添加事件时间
+
+		// 填充公共事件属性，与cuid、os、ov同名的属性由上传线程在填充这些属性之后再填充
+		const ZhugeCommonProperties& common_properties = *context.common_properties;
+		this->FillCommonEventProperties(event_ptr, common_properties, 0, common_properties.late_begin);
+		if (common_properties.late_begin < common_properties.properties.size()) {
+			event_ptr->track_context.common_properties = context.common_properties;
+		}
+	}
+
+	void ZhugeSDK::EnrichEvent(ZhugeEvent* event_ptr)
+	{
+		ZhugeTrackContext& context = event_ptr->track_context;
+		if (context.user_id) {
+			event_ptr->AddPropertyIfAbsent(ZG_KEY_CUID, *context.user_id);  // 添加cuid
+		}
+		if (context.deferred) {
+			if (context.sid != 0) {
+				event_ptr->AddPropertyIfAbsent(ZG_KEY_SID, context.sid);  // 添加会话ID
+			}
+			event_ptr->AddPropertyIfAbsent(ZG_KEY_TZ, this->sdk_config->time_zone); // 完善时区属性
+			event_ptr->AddPropertyIfAbsent(ZG_KEY_CT, context.ct);  //添加事件时间
+		}
+		if (this->platform_attributes) {  // 操作系统信息
+			event_ptr->AddPropertyIfAbsent<const Json::Value&>(ZG_KEY_OS, this->platform_attributes->os);
+			event_ptr->AddPropertyIfAbsent<const Json::Value&>(ZG_KEY_OV, this->platform_attributes->ov);
+		}
+		if (context.common_properties) {
+			// 延迟填充时填充全部公共属性，否则只填充与cuid、os、ov同名的属性
+			const ZhugeCommonProperties& common_properties = *context.common_properties;
+			this->FillCommonEventProperties(event_ptr, common_properties,
+				context.deferred ? 0 : common_properties.late_begin, common_properties.properties.size());
 		}
 
-		event_ptr->AddSystemPropertyIfAbsent("tz", this->sdk_config->time_zone); // 完善时区属性
+		context = ZhugeTrackContext();  // 释放公共属性快照，事件对象可能被回收重用
+	}
 
-		if (!event_ptr->HasSystemProperty("ct")) {
-			using namespace std::chrono;
-			const long long ts = duration_cast<milliseconds>(
-				system_clock::now().time_since_epoch()).count();
-			event_ptr->AddSystemProperty("ct", ts);  //添加事件时间
+	void ZhugeSDK::Track(ZhugeEvent&& event)
+	{
+		if (this->stopped.load()) {  // SDK已经暂停
+			this->metrics.events_dropped.Add(1);
+			return;
 		}
 
-		// 获取操作系统信息
-		if (!event_ptr->HasSystemProperty("os") && this->platform_info != nullptr) {
-			event_ptr->AddSystemProperty("os", platform_info->GetSystemStringProperty("os", "unknown"));
+		if (!this->AdmitEvent(event)) {  // 在取用对象池中的事件对象之前丢弃
+			return;
 		}
-		if (!event_ptr->HasSystemProperty("ov") && this->platform_info != nullptr) {
-			event_ptr->AddSystemProperty("ov", platform_info->GetSystemStringProperty("ov", "unknown"));
+
+		// 将属性交换到对象池中的事件对象，不复制属性
+		ZhugeEvent* event_ptr = this->GetEventPool().Acquire();
+		event_ptr->SwapData(event);
+		this->EnqueueEvent(event_ptr);
+	}
+
+	void ZhugeSDK::Track(std::unique_ptr<ZhugeEvent> event_ptr)
+	{
+		if (this->stopped.load()) {  // SDK已经暂停
+			this->metrics.events_dropped.Add(1);
+			return;
 		}
+		this->Track(event_ptr.release());
+	}
 
-		this->FillCommonEventProperties(event_ptr);  // 填充公共事件属性
+	ZhugeSDKPoolStats ZhugeSDK::GetPoolStats()
+	{
+		return this->GetEventPool().GetStats();
+	}
 
-		this->upload_process->AddUploadDataToQueue(event_ptr);
+	std::unique_ptr<ZhugeEvent> ZhugeSDK::NewEvent(const std::string& event_name)
+	{
+		return std::unique_ptr<ZhugeEvent>(this->GetEventPool().Acquire(event_name));
 	}
 
 	const TrackTimeHolder ZhugeSDK::StartTrack(ZhugeEvent* event_ptr)
 	{
-		using namespace std::chrono;
-		const long long ts = duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count();
-		event_ptr->AddSystemPropertyIfAbsent("ct", ts);
-		return{ event_ptr, ts };
+		const long long ts = this->GetClock().Now();
+		event_ptr->AddPropertyIfAbsent(ZG_KEY_CT, ts);
+		return{ event_ptr, ts, this->GetClock().SteadyNow() };
 	}
 
 	void ZhugeSDK::EndTrack(TrackTimeHolder& track_time_holder)
@@ -898,34 +3358,134 @@ namespace zhugeio
 			return;
 		}
 
-		using namespace std::chrono;
-		const long long ts = duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()).count();
-		const long long duration = ts - track_time_holder.begin_time;
+		// 使用单调时钟计算时长，避免系统时间调整导致时长错误
+		const long long duration = this->GetClock().SteadyNow() - track_time_holder.steady_begin_time;
 		ZhugeEvent* event_ptr = track_time_holder.event_ptr;
-		event_ptr->AddSystemProperty("dru", duration);
+		event_ptr->AddProperty(ZG_KEY_DRU, duration);
 		Track(event_ptr);
 	}
 
+	ZhugeSDKTLSStats ZhugeSDK::GetTLSStats()
+	{
+		return this->upload_process->GetTLSStats();
+	}
+
+	void ZhugeSDK::Log(ZhugeLogLevel level, const std::string& message, unsigned long long suppressed)
+	{
+		const size_t max_bytes = this->sdk_config->log_max_message_bytes;
+		const bool truncated = max_bytes > 0 && message.size() > max_bytes;
+		if (!truncated && suppressed == 0) {
+			this->logger->Log(level, message);
+			return;
+		}
+
+		std::string line;
+		if (truncated) {
+			size_t end = max_bytes;
+			while (end > 0 && (static_cast<unsigned char>(message[end]) & 0xC0) == 0x80) {  // 不截断UTF-8字符
+				end--;
+			}
+			line.assign(message, 0, end);
+			line.append("...(").append(std::to_string(message.size())).append(" bytes)");
+		}
+		else {
+			line = message;
+		}
+		if (suppressed > 0) {
+			line.append(" (").append(std::to_string(suppressed)).append(" similar messages suppressed)");
+		}
+		this->logger->Log(level, line);
+	}
+
+	ZhugeSDKStats ZhugeSDK::GetStats()
+	{
+		// 上传线程记录的指标都在所属的SDK对象中
+		const ZhugeSDKMetrics& engine = this->host->metrics;
+		ZhugeSDKStats stats;
+		stats.events_tracked = this->metrics.events_tracked.Value();
+		stats.events_dropped = this->metrics.events_dropped.Value();
+		stats.events_sampled = this->metrics.events_sampled.Value();
+		stats.queue_depth = engine.queue_depth.Value();
+		stats.batches_saved = engine.batches_saved.Value();
+		stats.batches_dropped = engine.batches_dropped.Value();
+		stats.batches_uploaded = engine.batches_uploaded.Value();
+		stats.upload_requests = engine.upload_requests.Value();
+		stats.upload_failures = engine.upload_failures.Value();
+		stats.bytes_sent = engine.bytes_sent.Value();
+		stats.spool_batches = engine.spool_batches.Value();
+		stats.spool_bytes = engine.spool_bytes.Value();
+		stats.track_latency = this->metrics.track_latency.GetStats();
+		if (this->host == this) {
+			// 租户共用上传线程与队列，所属的SDK对象的提交、丢弃事件数与Track耗时包含所有租户
+			std::lock_guard<std::mutex> lock(this->tenants_mutex);
+			if (!this->tenants.empty()) {
+				ZhugeSDKHistogram track_latency;
+				this->metrics.track_latency.AddTo(track_latency);
+				for (auto& tenant : this->tenants) {
+					const ZhugeSDKMetrics& tenant_metrics = tenant.second->metrics;
+					stats.events_tracked += tenant_metrics.events_tracked.Value();
+					stats.events_dropped += tenant_metrics.events_dropped.Value();
+					stats.events_sampled += tenant_metrics.events_sampled.Value();
+					tenant_metrics.track_latency.AddTo(track_latency);
+				}
+				stats.track_latency = track_latency.GetStats();
+			}
+		}
+		stats.serialize_latency = engine.serialize_latency.GetStats();
+		stats.upload_latency = engine.upload_latency.GetStats();
+		stats.tls = this->GetTLSStats();
+		stats.pool = this->GetEventPool().GetStats();
+		return stats;
+	}
+
+	std::future<bool> ZhugeSDK::Flush()
+	{
+		return this->upload_process->Flush();
+	}
+
+	void ZhugeSDK::StopAccepting()
+	{
+		this->stopped.store(true);
+		std::lock_guard<std::mutex> lock(this->tenants_mutex);
+		for (auto& tenant : this->tenants) {
+			tenant.second->stopped.store(true);
+		}
+	}
+
 	void ZhugeSDK::Shutdown(int timeout)
 	{
-		if (this->sdk_config->enable_log) {
-			std::clog << "[ZhugeSDK] shutdown..." << std::endl;
+		ZHUGE_LOG(this, ZHUGE_LOG_INFO, "shutdown...");
+		this->StopAccepting();
+		if (this->host != this) {  // 上传线程由所属的SDK对象终止
+			return;
 		}
 		this->upload_process->Stop(timeout);
+		delete this->metrics_server;
+		this->metrics_server = nullptr;
 	}
 
 	void ZhugeSDK::Shutdown()
 	{
-		if (this->sdk_config->enable_log) {
-			std::clog << "[ZhugeSDK] shutdown..." << std::endl;
+		ZHUGE_LOG(this, ZHUGE_LOG_INFO, "shutdown...");
+		this->StopAccepting();
+		if (this->host != this) {  // 上传线程由所属的SDK对象终止
+			return;
 		}
 		this->upload_process->Stop();
+		delete this->metrics_server;
+		this->metrics_server = nullptr;
 	}
 
 	ZhugeSDK::~ZhugeSDK()
 	{
-		delete this->upload_process;
+		if (this->host != this) {  // 共用的资源由所属的SDK对象释放
+			return;
+		}
+		delete this->metrics_server;
+		delete this->upload_process;  // 上传线程退出之前还会序列化租户的数据，之后再释放租户
+		for (auto& tenant : this->tenants) {
+			delete tenant.second;
+		}
 		delete this->sdk_config;
 	}
 
@@ -947,7 +3507,27 @@ namespace zhugeio
 		api_read_timeout(DEFAULT_API_READ_TIMEOUT_S),
 		api_write_timeout(DEFAULT_API_WRITE_TIMEOUT_S),
 		max_storage_records(DEFAULT_MAX_STORAGE_RECORDS),
-		storage_file_path(""){};
+		storage_file_path(""),
+		repair_storage(false),
+		spill_file_path(""),
+		upload_body_mode(ZHUGE_UPLOAD_BODY_FORM),
+		max_frame_bytes(DEFAULT_MAX_FRAME_BYTES),
+		max_upload_bytes_per_second(0),
+		upload_burst_bytes(0),
+		max_upload_requests_per_second(0),
+		clock_resolution_milliseconds(0),
+		deferred_enrichment(false),
+		metrics_host(DEFAULT_METRICS_HOST),
+		metrics_port(0),
+		log_level(ZHUGE_LOG_DEBUG),  // 只开启EnableLog时与之前一样输出全部调试日志
+		log_max_message_bytes(DEFAULT_LOG_MAX_MESSAGE_BYTES),
+		max_log_messages_per_second(DEFAULT_LOG_MESSAGES_PER_SECOND),
+		trace_sample_interval(DEFAULT_TRACE_SAMPLE_INTERVAL),
+		max_queued_events(0)
+	{
+		ZhugeSDKEndpoint endpoint = { api_host, api_port };
+		this->api_endpoints.push_back(endpoint);
+	};
 
 	ZhugeSDKConfig& ZhugeSDKConfig::APIPath(std::string api_path)
 	{
@@ -1021,24 +3601,178 @@ namespace zhugeio
 		return *this;
 	}
 
-	ZhugeSDKConfig& ZhugeSDKConfig::StorageFilePath(const std::string storage_file_path)
+	// 补全数据目录末尾的分隔符，并确保目录存在
+	static std::string ZhugeDataDirectory(const std::string& path)
 	{
-		this->storage_file_path = storage_file_path;
-		if (!storage_file_path.empty()) {  // 非空字符串
+		std::string directory = path;
+		if (!path.empty()) {  // 非空字符串
 #ifdef _WIN32
-			if (storage_file_path.at(storage_file_path.size() - 1) != '\\') {
-				this->storage_file_path += "\\";
+			if (path.at(path.size() - 1) != '\\') {
+				directory += "\\";
 			}
-			const std::string cmd = "mkdir " + this->storage_file_path + " 2> NUL";
+			const std::string cmd = "mkdir " + directory + " 2> NUL";
 			system(cmd.c_str());  // ensure the data dir existed
 #else
-			if (storage_file_path.at(storage_file_path.size() - 1) != '/') {
-				this->storage_file_path += "/";
+			if (path.at(path.size() - 1) != '/') {
+				directory += "/";
 			}
-			const std::string cmd = "mkdir -p " + this->storage_file_path;
+			const std::string cmd = "mkdir -p " + directory;
 			system(cmd.c_str());  // ensure the data dir existed
 #endif
 		}
+		return directory;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::StorageFilePath(const std::string storage_file_path)
+	{
+		this->storage_file_path = ZhugeDataDirectory(storage_file_path);
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::RepairStorage(const bool repair_storage)
+	{
+		this->repair_storage = repair_storage;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::SpillFilePath(const std::string spill_file_path)
+	{
+		this->spill_file_path = ZhugeDataDirectory(spill_file_path);
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::UploadBodyMode(const std::string upload_body_mode)
+	{
+		this->upload_body_mode = upload_body_mode;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MaxFrameBytes(const size_t max_frame_bytes)
+	{
+		this->max_frame_bytes = max_frame_bytes;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MaxUploadBytesPerSecond(const size_t max_upload_bytes_per_second)
+	{
+		this->max_upload_bytes_per_second = max_upload_bytes_per_second;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::UploadBurstBytes(const size_t upload_burst_bytes)
+	{
+		this->upload_burst_bytes = upload_burst_bytes;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MaxUploadRequestsPerSecond(const double max_upload_requests_per_second)
+	{
+		this->max_upload_requests_per_second = max_upload_requests_per_second;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::ClockResolutionMilliseconds(const int clock_resolution_milliseconds)
+	{
+		this->clock_resolution_milliseconds = clock_resolution_milliseconds;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::DeferredEnrichment(const bool deferred_enrichment)
+	{
+		this->deferred_enrichment = deferred_enrichment;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MetricsHost(const std::string metrics_host)
+	{
+		this->metrics_host = metrics_host;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MetricsPort(const int metrics_port)
+	{
+		this->metrics_port = metrics_port;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::LogLevel(const ZhugeLogLevel log_level)
+	{
+		this->log_level = log_level;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::Logger(std::shared_ptr<ZhugeSDKLogger> logger)
+	{
+		this->logger = logger;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::LogMaxMessageBytes(const size_t log_max_message_bytes)
+	{
+		this->log_max_message_bytes = log_max_message_bytes;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MaxLogMessagesPerSecond(const int max_log_messages_per_second)
+	{
+		this->max_log_messages_per_second = max_log_messages_per_second;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::Tracer(std::shared_ptr<ZhugeSDKTracer> tracer)
+	{
+		this->tracer = tracer;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::TraceSampleInterval(const int trace_sample_interval)
+	{
+		this->trace_sample_interval = trace_sample_interval;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::UploadCallback(ZhugeSDKUploadCallback upload_callback)
+	{
+		this->upload_callback = upload_callback;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::MaxQueuedEvents(const size_t max_queued_events)
+	{
+		this->max_queued_events = max_queued_events;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::Executor(std::shared_ptr<ZhugeSDKExecutor> executor)
+	{
+		this->executor = executor;
+		return *this;
+	}
+
+	// 获取事件名称对应的策略，不存在时添加默认策略
+	static ZhugeEventPolicy& ZhugeEventPolicyOf(
+		std::unordered_map<std::string, ZhugeEventPolicy>& event_policies, const std::string& event_name)
+	{
+		ZhugeEventPolicy default_policy = { ZHUGE_EVENT_NORMAL, 1.0 };
+		return event_policies.insert(std::make_pair(event_name, default_policy)).first->second;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::EventSampleRate(const std::string& event_name, const double sample_rate)
+	{
+		ZhugeEventPolicyOf(this->event_policies, event_name).sample_rate = std::max(0.0, std::min(1.0, sample_rate));
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::EventPriority(const std::string& event_name, const ZhugeEventPriority priority)
+	{
+		ZhugeEventPolicyOf(this->event_policies, event_name).priority = priority;
+		return *this;
+	}
+
+	ZhugeSDKConfig& ZhugeSDKConfig::AddAPIEndpoint(const std::string api_host, const int api_port)
+	{
+		ZhugeSDKEndpoint endpoint = { api_host, api_port };
+		this->api_endpoints.push_back(endpoint);
 		return *this;
 	}
 
@@ -1059,6 +3793,27 @@ namespace zhugeio
 			<< ", api_read_timeout = " << config.api_read_timeout
 			<< ", api_write_timeout = " << config.api_write_timeout
 			<< ", max_storage_records = " << config.max_send_size
+			<< ", repair_storage = " << config.repair_storage
+			<< ", api_endpoints = " << config.api_endpoints.size()
+			<< ", upload_body_mode = " << config.upload_body_mode
+			<< ", max_frame_bytes = " << config.max_frame_bytes
+			<< ", max_upload_bytes_per_second = " << config.max_upload_bytes_per_second
+			<< ", upload_burst_bytes = " << config.upload_burst_bytes
+			<< ", max_upload_requests_per_second = " << config.max_upload_requests_per_second
+			<< ", clock_resolution_milliseconds = " << config.clock_resolution_milliseconds
+			<< ", deferred_enrichment = " << config.deferred_enrichment
+			<< ", metrics_host = " << config.metrics_host
+			<< ", metrics_port = " << config.metrics_port
+			<< ", log_level = " << ZhugeLogLevelName(config.log_level)
+			<< ", log_max_message_bytes = " << config.log_max_message_bytes
+			<< ", max_log_messages_per_second = " << config.max_log_messages_per_second
+			<< ", enable_trace = " << (config.tracer ? "true" : "false")
+			<< ", trace_sample_interval = " << config.trace_sample_interval
+			<< ", enable_upload_callback = " << (config.upload_callback ? "true" : "false")
+			<< ", spill_file_path = " << config.spill_file_path
+			<< ", max_queued_events = " << config.max_queued_events
+			<< ", shared_executor = " << (config.executor ? "true" : "false")
+			<< ", event_policies = " << config.event_policies.size()
 			<< "]";
 	}
 
@@ -1073,9 +3828,7 @@ namespace zhugeio
 
 		ZhugeSDKConfig* sdk_config = new ZhugeSDKConfig(api_host, api_port, app_key);
 		zhuge_sdk = new ZhugeSDK(sdk_config);
-		if (sdk_config->enable_log) {
-			std::clog << "[ZhugeSDK] Init zhuge sdk, config items: " << *sdk_config << std::endl;
-		}
+		ZHUGE_LOG(zhuge_sdk, ZHUGE_LOG_INFO, "Init zhuge sdk, config items: " << *sdk_config);
 		zhuge_sdk->StartProcess();
 	}
 
@@ -1086,12 +3839,15 @@ namespace zhugeio
 			throw ZhugeSDKException("zhuge_sdk has already been initialized!");
 		}
 		zhuge_sdk = new ZhugeSDK(new ZhugeSDKConfig(zhuge_sdk_config));
-		if (zhuge_sdk_config.enable_log) {
-			std::clog << "[ZhugeSDK] Init zhuge sdk, config items: " << zhuge_sdk_config << std::endl;
-		}
+		ZHUGE_LOG(zhuge_sdk, ZHUGE_LOG_INFO, "Init zhuge sdk, config items: " << zhuge_sdk_config);
 		zhuge_sdk->StartProcess();
 	}
 
+	std::future<bool> flush_zhuge_sdk()
+	{
+		return zhuge_sdk->Flush();
+	}
+
 	void shutdown_zhuge_sdk()
 	{
 		zhuge_sdk->Shutdown();